@@ -39,12 +39,20 @@ static struct list_head *l = NULL;
 static char random_string[N_MEASURES][8];
 static int random_string_iter = 0;
 
+/* Number of elements removed per measurement of remove_head_n */
+static int dut_batch = DUT_BATCH;
+
 /* Implement the necessary queue interface to simulation */
 void init_dut(void)
 {
     l = NULL;
 }
 
+void set_dut_batch(int n)
+{
+    dut_batch = n > 0 ? n : DUT_BATCH;
+}
+
 static char *get_random_string(void)
 {
     random_string_iter = (random_string_iter + 1) % N_MEASURES;
@@ -67,13 +75,44 @@ void prepare_inputs(uint8_t *input_data, uint8_t *classes)
     }
 }
 
+/* Measure q_detach_head(), or q_detach_tail() if tail is set */
+static bool measure_detach(int64_t *before_ticks,
+                           int64_t *after_ticks,
+                           uint8_t *input_data,
+                           bool tail)
+{
+    for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
+        dut_new();
+        dut_insert_head(
+            get_random_string(),
+            *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000 + 1);
+        int before_size = q_size(l);
+        const char *value = tail ? list_last_entry(l, element_t, list)->value
+                                 : list_first_entry(l, element_t, list)->value;
+        before_ticks[i] = cpucycles();
+        element_t *e = tail ? q_detach_tail(l) : q_detach_head(l);
+        after_ticks[i] = cpucycles();
+        int after_size = q_size(l);
+        /* The string must come out in place, not as a copy */
+        bool in_place = e && e->value == value;
+        if (e)
+            q_release_element(e);
+        dut_free();
+        if (before_size != after_size + 1 || !in_place)
+            return false;
+    }
+    return true;
+}
+
 bool measure(int64_t *before_ticks,
              int64_t *after_ticks,
              uint8_t *input_data,
              int mode)
 {
     assert(mode == DUT(insert_head) || mode == DUT(insert_tail) ||
-           mode == DUT(remove_head) || mode == DUT(remove_tail));
+           mode == DUT(remove_head) || mode == DUT(remove_tail) ||
+           mode == DUT(detach_head) || mode == DUT(detach_tail) ||
+           mode == DUT(remove_head_n));
 
     switch (mode) {
     case DUT(insert_head):
@@ -146,6 +185,32 @@ bool measure(int64_t *before_ticks,
                 return false;
         }
         break;
+    case DUT(detach_head):
+        return measure_detach(before_ticks, after_ticks, input_data, false);
+    case DUT(detach_tail):
+        return measure_detach(before_ticks, after_ticks, input_data, true);
+    case DUT(remove_head_n):
+        for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
+            dut_new();
+            /* Long enough for the batch to be walked from the head */
+            dut_insert_head(
+                get_random_string(),
+                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000 +
+                    2 * dut_batch);
+            int before_size = q_size(l);
+            LIST_HEAD(removed);
+            before_ticks[i] = cpucycles();
+            int n = q_remove_head_n(l, &removed, dut_batch);
+            after_ticks[i] = cpucycles();
+            int after_size = q_size(l);
+            element_t *e, *safe;
+            list_for_each_entry_safe(e, safe, &removed, list)
+                q_release_element(e);
+            dut_free();
+            if (n != dut_batch || before_size != after_size + n)
+                return false;
+        }
+        break;
     default:
         for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
             dut_new();
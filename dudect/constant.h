@@ -12,11 +12,14 @@
 
 #define DROP_SIZE 20
 
-#define DUT_FUNCS  \
-    _(insert_head) \
-    _(insert_tail) \
-    _(remove_head) \
-    _(remove_tail)
+#define DUT_FUNCS    \
+    _(insert_head)   \
+    _(insert_tail)   \
+    _(remove_head)   \
+    _(remove_tail)   \
+    _(detach_head)   \
+    _(detach_tail)   \
+    _(remove_head_n)
 
 #define DUT(x) DUT_##x
 
@@ -26,7 +29,11 @@ enum {
 #undef _
 };
 
+/* Default number of elements removed at once by remove_head_n */
+#define DUT_BATCH 16
+
 void init_dut();
+void set_dut_batch(int n);
 void prepare_inputs(uint8_t *input_data, uint8_t *classes);
 bool measure(int64_t *before_ticks,
              int64_t *after_ticks,
@@ -30,19 +30,31 @@
 
 /* Data structures used by our code */
 
-/* Represent allocated blocks as doubly-linked list, with
- * next and prev pointers at beginning
- */
+/* Header placed in front of every allocated block */
 typedef struct __block_element {
-    struct __block_element *next, *prev;
     size_t payload_size;
     size_t magic_header; /* Marker to see if block seems legitimate */
     unsigned char payload[0];
     /* Also place magic number at tail of every block */
 } block_element_t;
 
-static block_element_t *allocated = NULL;
+/* Allocated blocks are indexed by address in an open-addressing hash table
+ * with linear probing, so that looking a block up takes constant time.
+ */
+#define INDEX_MIN_SLOTS 1024
+
+static block_element_t **allocated = NULL;
+static size_t allocated_slots = 0;
 static size_t allocated_count = 0;
+static size_t allocated_bytes = 0;
+
+/* Blocks handed out by plain malloc in HARNESS_OFF mode. They are not
+ * reported as leaks, but they keep the mode from changing under them.
+ */
+static size_t untracked_count = 0;
+
+/* How much bookkeeping is done, one of HARNESS_* */
+static int harness_mode = HARNESS_FULL;
 
 /* Percent probability of malloc failure */
 int fail_probability = 0;
@@ -74,6 +86,79 @@ static bool fail_allocation()
     return (weight < 0.01 * fail_probability);
 }
 
+/* Home slot of block b in the index */
+static size_t index_slot(const block_element_t *b)
+{
+    /* Fibonacci hashing, low bits are the same for all blocks */
+    uint64_t h = (uint64_t) (uintptr_t) b * 0x9e3779b97f4a7c15ULL;
+    return (size_t) (h >> 32) & (allocated_slots - 1);
+}
+
+/* Slot holding block b, or the empty slot where it would be inserted */
+static size_t index_find(const block_element_t *b)
+{
+    size_t i = index_slot(b);
+    while (allocated[i] && allocated[i] != b)
+        i = (i + 1) & (allocated_slots - 1);
+    return i;
+}
+
+/* Resize the index to slots entries, return false if out of memory */
+static bool index_resize(size_t slots)
+{
+    block_element_t **old = allocated;
+    size_t old_slots = allocated_slots;
+
+    allocated = calloc(slots, sizeof(*allocated));
+    if (!allocated) {
+        allocated = old;
+        return false;
+    }
+    allocated_slots = slots;
+    for (size_t i = 0; i < old_slots; i++) {
+        if (old[i])
+            allocated[index_find(old[i])] = old[i];
+    }
+    free(old);
+    return true;
+}
+
+/* Record block b as allocated, keeping the load factor at most 1/2 */
+static bool index_insert(block_element_t *b)
+{
+    if (2 * (allocated_count + 1) > allocated_slots &&
+        !index_resize(allocated_slots ? 2 * allocated_slots
+                                      : INDEX_MIN_SLOTS))
+        return false;
+    allocated[index_find(b)] = b;
+    allocated_count++;
+    return true;
+}
+
+/* Forget block b, return false if it was not allocated */
+static bool index_remove(const block_element_t *b)
+{
+    if (!allocated_count)
+        return false;
+
+    size_t hole = index_find(b);
+    if (!allocated[hole])
+        return false;
+
+    /* Shift back the entries following the hole that probed past it */
+    size_t mask = allocated_slots - 1;
+    for (size_t i = (hole + 1) & mask; allocated[i]; i = (i + 1) & mask) {
+        size_t home = index_slot(allocated[i]);
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            allocated[hole] = allocated[i];
+            hole = i;
+        }
+    }
+    allocated[hole] = NULL;
+    allocated_count--;
+    return true;
+}
+
 /* Find header of block, given its payload.
  * Signal error if doesn't seem like legitimate block
  */
@@ -88,13 +173,7 @@ static block_element_t *find_header(void *p)
         (block_element_t *) ((size_t) p - sizeof(block_element_t));
     if (cautious_mode) {
         /* Make sure this is really an allocated block */
-        block_element_t *ab = allocated;
-        bool found = false;
-        while (ab && !found) {
-            found = ab == b;
-            ab = ab->next;
-        }
-        if (!found) {
+        if (!allocated_count || !allocated[index_find(b)]) {
             report_event(MSG_ERROR,
                          "Attempted to free unallocated block.  Address = %p",
                          p);
@@ -142,6 +221,30 @@ static void *alloc(alloc_t alloc_type, size_t size)
         return NULL;
     }
 
+    if (harness_mode == HARNESS_OFF) {
+        void *p = alloc_type == TEST_CALLOC ? calloc(1, size) : malloc(size);
+        if (p)
+            untracked_count++;
+        return p;
+    }
+
+    if (harness_mode == HARNESS_COUNTING) {
+        /* Only the size is kept, for the byte total */
+        block_element_t *new_block =
+            alloc_type == TEST_CALLOC
+                ? calloc(1, size + sizeof(block_element_t))
+                : malloc(size + sizeof(block_element_t));
+        if (!new_block) {
+            report_event(MSG_FATAL, "Couldn't allocate any more memory");
+            error_occurred = true;
+            return NULL;
+        }
+        new_block->payload_size = size;
+        allocated_count++;
+        allocated_bytes += size;
+        return (void *) &new_block->payload;
+    }
+
     block_element_t *new_block =
         malloc(size + sizeof(block_element_t) + sizeof(size_t));
     if (!new_block) {
@@ -156,15 +259,15 @@ static void *alloc(alloc_t alloc_type, size_t size)
     *find_footer(new_block) = MAGICFOOTER;
     void *p = (void *) &new_block->payload;
     memset(p, !alloc_type * FILLCHAR, size);
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->next = allocated;
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->prev = NULL;
 
-    if (allocated)
-        allocated->prev = new_block;
-    allocated = new_block;
-    allocated_count++;
+    /* A block missing from the index would be rejected by test_free() */
+    if (!index_insert(new_block)) {
+        free(new_block);
+        report_event(MSG_FATAL, "Couldn't allocate any more memory");
+        error_occurred = true;
+        return NULL;
+    }
+    allocated_bytes += size;
 
     return p;
 }
@@ -197,7 +300,26 @@ void test_free(void *p)
     if (!p)
         return;
 
+    if (harness_mode == HARNESS_OFF) {
+        untracked_count--;
+        free(p);
+        return;
+    }
+
+    if (harness_mode == HARNESS_COUNTING) {
+        block_element_t *b =
+            (block_element_t *) ((size_t) p - sizeof(block_element_t));
+        allocated_count--;
+        allocated_bytes -= b->payload_size;
+        free(b);
+        return;
+    }
+
     block_element_t *b = find_header(p);
+    /* In cautious mode, find_header() already reported an unknown block */
+    if (!index_remove(b))
+        return;
+
     size_t footer = *find_footer(b);
     if (footer != MAGICFOOTER) {
         report_event(MSG_ERROR,
@@ -209,19 +331,9 @@ void test_free(void *p)
     b->magic_header = MAGICFREE;
     *find_footer(b) = MAGICFREE;
     memset(p, FILLCHAR, b->payload_size);
-
-    /* Unlink from list */
-    block_element_t *bn = b->next;
-    block_element_t *bp = b->prev;
-    if (bp)
-        bp->next = bn;
-    else
-        allocated = bn;
-    if (bn)
-        bn->prev = bp;
+    allocated_bytes -= b->payload_size;
 
     free(b);
-    allocated_count--;
 }
 
 // cppcheck-suppress unusedFunction
@@ -240,6 +352,11 @@ size_t allocation_check()
     return allocated_count;
 }
 
+size_t allocation_bytes()
+{
+    return allocated_bytes;
+}
+
 /* Implementation of functions for testing */
 
 /* Set/unset cautious mode.
@@ -250,6 +367,20 @@ void set_cautious_mode(bool cautious)
     cautious_mode = cautious;
 }
 
+/* Select how much bookkeeping the allocator does.
+ * Blocks carry a different header in each mode, so the mode can only be
+ * changed while none is allocated.
+ */
+bool set_harness_mode(int mode)
+{
+    if (mode < HARNESS_FULL || mode > HARNESS_OFF)
+        return false;
+    if (mode != harness_mode && (allocated_count || untracked_count))
+        return false;
+    harness_mode = mode;
+    return true;
+}
+
 /* Set/unset restricted allocation mode.
  * In this mode, calls to malloc and free are disallowed.
  */
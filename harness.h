@@ -21,6 +21,9 @@ char *test_strdup(const char *s);
 /* Report number of allocated blocks */
 size_t allocation_check();
 
+/* Report number of bytes in allocated blocks */
+size_t allocation_bytes();
+
 /* Probability of malloc failing, expressed as percent */
 extern int fail_probability;
 
@@ -30,6 +33,20 @@ extern int fail_probability;
  */
 void set_cautious_mode(bool cautious);
 
+/* Bookkeeping levels of the allocator */
+typedef enum {
+    HARNESS_FULL,     /* guard words, fill patterns and a block index */
+    HARNESS_COUNTING, /* block count and byte total only */
+    HARNESS_OFF,      /* plain malloc and free, no leak checking */
+} harness_mode_t;
+
+/*
+ * Select the bookkeeping level, one of harness_mode_t.
+ * Fails if the level is invalid, or if blocks are allocated and the level
+ * differs from the current one.
+ */
+bool set_harness_mode(int mode);
+
 /*
  * Set/unset restricted allocation mode.
  * In this mode, calls to malloc and free are disallowed.
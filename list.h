@@ -23,6 +23,13 @@ extern "C" {
 #define __LIST_HAVE_TYPEOF 0
 #endif
 
+/* Inline even where the compiler would not, see list_merge() */
+#if defined(__GNUC__) || defined(__clang__)
+#define __LIST_ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define __LIST_ALWAYS_INLINE inline
+#endif
+
 /**
  * struct list_head - Node structure for a circular doubly-linked list
  * @next: Pointer to the next node in the list.
@@ -462,6 +469,236 @@ static inline void list_move_tail(struct list_head *node,
          ++(entry), ++(safe))
 #endif
 
+/**
+ * list_prefetch() - Hint that memory is going to be read soon
+ * @addr: address to fetch into the cache, may be NULL
+ *
+ * Expands to __builtin_prefetch() where available and to nothing otherwise.
+ * A prefetch never faults, so @addr need not point to valid memory.
+ */
+#if defined(__GNUC__) || defined(__clang__)
+#define list_prefetch(addr) __builtin_prefetch(addr)
+#else
+#define list_prefetch(addr) ((void) (addr))
+#endif
+
+/**
+ * list_for_each_prefetch - Iterate over list nodes, prefetching ahead
+ * @node: list_head pointer used as iterator
+ * @head: pointer to the head of the list
+ *
+ * Same as list_for_each(), but the node after the next one is prefetched
+ * while the body runs on @node, so that walking a list whose nodes are
+ * scattered in memory overlaps the cache misses instead of taking them one
+ * after the other.
+ */
+#define list_for_each_prefetch(node, head)                          \
+    for (node = (head)->next;                                       \
+         node != (head) && (list_prefetch(node->next->next), 1); \
+         node = node->next)
+
+/**
+ * list_for_each_safe_prefetch - Iterate over list nodes, allowing removal and
+ * prefetching ahead
+ * @node: Pointer to a list_head structure, used as the loop iterator.
+ * @safe: Pointer to a list_head structure, storing the next node for safe
+ *        iteration.
+ * @head: Pointer to the list_head structure representing the list head.
+ *
+ * Same as list_for_each_safe(), with the prefetching of
+ * list_for_each_prefetch().
+ */
+#define list_for_each_safe_prefetch(node, safe, head)      \
+    for (node = (head)->next, safe = node->next;           \
+         node != (head) && (list_prefetch(safe->next), 1); \
+         node = safe, safe = node->next)
+
+/**
+ * list_for_each_entry_prefetch - Iterate over a list of entries, prefetching
+ * ahead
+ * @entry: Pointer to the structure type, used as the loop iterator.
+ * @head: Pointer to the list_head structure representing the list head.
+ * @member: Name of the list_head member within the structure type of @entry.
+ * @field: Name of a pointer member of the structure type of @entry.
+ *
+ * Same as list_for_each_entry(), but while the body runs on @entry, the node
+ * after the next one is prefetched, and so is the memory @field of the next
+ * entry points to, e.g. a string the body is going to read.
+ */
+#if __LIST_HAVE_TYPEOF
+#define list_for_each_entry_prefetch(entry, head, member, field)            \
+    for (entry = list_entry((head)->next, typeof(*entry), member);          \
+         &entry->member != (head) &&                                        \
+         (list_prefetch(entry->member.next->next),                          \
+          list_prefetch(entry->member.next != (head)                        \
+                            ? (const void *) list_entry(entry->member.next, \
+                                                        typeof(*entry),     \
+                                                        member)             \
+                                  ->field                                   \
+                            : NULL),                                        \
+          1);                                                               \
+         entry = list_entry(entry->member.next, typeof(*entry), member))
+#else
+#define list_for_each_entry_prefetch(entry, head, member, field) \
+    for (entry = (void *) 1; sizeof(struct { int i : -1; }); ++(entry))
+#endif
+
+/**
+ * list_for_each_entry_safe_prefetch - Iterate over a list, allowing node
+ * removal and prefetching ahead
+ * @entry: Pointer to the structure type, used as the loop iterator.
+ * @safe: Pointer to the structure type, storing the next entry for safe
+ * iteration.
+ * @head: Pointer to the list_head structure representing the list head.
+ * @member: Name of the list_head member within the structure type of @entry.
+ * @field: Name of a pointer member of the structure type of @entry.
+ *
+ * Same as list_for_each_entry_safe(), with the prefetching of
+ * list_for_each_entry_prefetch().
+ */
+#if __LIST_HAVE_TYPEOF
+#define list_for_each_entry_safe_prefetch(entry, safe, head, member, field) \
+    for (entry = list_entry((head)->next, typeof(*entry), member),          \
+        safe = list_entry(entry->member.next, typeof(*entry), member);      \
+         &entry->member != (head) &&                                        \
+         (list_prefetch(safe->member.next),                                 \
+          list_prefetch(&safe->member != (head)                             \
+                            ? (const void *) safe->field                    \
+                            : NULL),                                        \
+          1);                                                               \
+         entry = safe,                                                      \
+        safe = list_entry(safe->member.next, typeof(*entry), member))
+#else
+#define list_for_each_entry_safe_prefetch(entry, safe, head, member, field) \
+    for (entry = safe = (void *) 1; sizeof(struct { int i : -1; });      \
+         ++(entry), ++(safe))
+#endif
+
+/**
+ * list_cmp_func_t - Comparison function for list_merge() and list_sort()
+ * @priv: private data passed through unchanged
+ * @a: pointer to the node which currently comes first
+ * @b: pointer to the node which currently comes second
+ *
+ * Return: a value greater than zero if @a has to be placed after @b, and zero
+ * or less to keep @a before @b. Returning zero for equal nodes keeps the sort
+ * stable; any order, descending included, is expressed by the comparator.
+ */
+typedef int (*list_cmp_func_t)(void *priv,
+                               const struct list_head *a,
+                               const struct list_head *b);
+
+/**
+ * list_merge() - Merge two sorted NULL-terminated chains of nodes
+ * @priv: private data passed to @cmp
+ * @cmp: comparison function
+ * @a: first sorted chain, linked through @next and ending with NULL
+ * @b: second sorted chain, linked through @next and ending with NULL
+ *
+ * Nodes of @a are placed before equal nodes of @b. Only the @next pointers of
+ * the result are valid.
+ *
+ * Always inlined, so that a constant @cmp is called directly, or inlined, by
+ * the loop instead of through a pointer.
+ *
+ * Return: the first node of the merged chain
+ */
+static __LIST_ALWAYS_INLINE struct list_head *list_merge(void *priv,
+                                                         list_cmp_func_t cmp,
+                                                         struct list_head *a,
+                                                         struct list_head *b)
+{
+    struct list_head *head = NULL, **tail = &head;
+
+    while (a && b) {
+        if (cmp(priv, a, b) <= 0) {
+            *tail = a;
+            a = a->next;
+        } else {
+            *tail = b;
+            b = b->next;
+        }
+        tail = &(*tail)->next;
+    }
+    *tail = a ? a : b;
+
+    return head;
+}
+
+/**
+ * list_sort() - Sort a list with a stable merge sort
+ * @priv: private data passed to @cmp
+ * @head: pointer to the head of the list
+ * @cmp: comparison function
+ *
+ * The list is cut into its natural runs: ascending runs, and strictly
+ * descending runs which are reversed while detached. The runs are kept on a
+ * stack where every run is more than twice as long as the one above it, and
+ * merged as soon as that would be violated. The merges stay balanced, the
+ * stack is bounded by the bit width of size_t, and sorted or reverse sorted
+ * lists are done with one comparison per node. No memory is allocated. Like
+ * list_merge(), it is always inlined for the sake of a constant @cmp.
+ */
+static __LIST_ALWAYS_INLINE void list_sort(void *priv,
+                                           struct list_head *head,
+                                           list_cmp_func_t cmp)
+{
+    struct list_head *pending[8 * sizeof(size_t)], *node = head->next;
+    size_t size[8 * sizeof(size_t)];
+    int depth = 0;
+
+    if (node == head->prev)
+        return;
+
+    while (node != head) {
+        struct list_head *run = node, *next = node->next;
+        size_t len = 1;
+
+        if (next != head && cmp(priv, node, next) > 0) {
+            node->next = NULL;
+            while (next != head && cmp(priv, run, next) > 0) {
+                struct list_head *after = next->next;
+                next->next = run;
+                run = next;
+                next = after;
+                len++;
+            }
+        } else {
+            while (next != head && cmp(priv, node, next) <= 0) {
+                node = next;
+                next = next->next;
+                len++;
+            }
+            node->next = NULL;
+        }
+        node = next;
+
+        pending[depth] = run;
+        size[depth++] = len;
+        while (depth > 1 && size[depth - 2] <= 2 * size[depth - 1]) {
+            pending[depth - 2] =
+                list_merge(priv, cmp, pending[depth - 2], pending[depth - 1]);
+            size[depth - 2] += size[depth - 1];
+            depth--;
+        }
+    }
+
+    while (depth > 1) {
+        pending[depth - 2] =
+            list_merge(priv, cmp, pending[depth - 2], pending[depth - 1]);
+        depth--;
+    }
+
+    /* Restore the prev pointers and close the circle */
+    struct list_head *prev = head;
+    for (node = pending[0]; node; prev = node, node = node->next) {
+        prev->next = node;
+        node->prev = prev;
+    }
+    prev->next = head;
+    head->prev = prev;
+}
+
 #undef __LIST_HAVE_TYPEOF
 
 #ifdef __cplusplus
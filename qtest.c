@@ -2,7 +2,10 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
 #include <signal.h>
 #include <spawn.h>
 #include <stdio.h>
@@ -24,7 +27,7 @@
 #include "random.h"
 
 /* Shannon entropy */
-extern double shannon_entropy(const uint8_t *input_data);
+extern double shannon_entropy(const uint8_t *input_data, size_t len);
 extern int show_entropy;
 
 /* Our program needs to use regular malloc/free */
@@ -46,6 +49,7 @@ extern int show_entropy;
 
 #include "console.h"
 #include "report.h"
+#include "typed_queue.h"
 
 /* Settable parameters */
 
@@ -53,7 +57,6 @@ extern int show_entropy;
 
 /* How large is a queue before it's considered big.
  * This affects how it gets printed
- * and whether cautious mode is used when freeing the queue
  */
 #define BIG_LIST_SIZE 30
 
@@ -75,6 +78,27 @@ static int string_length = MAXSTRING;
 
 static int descend = 0;
 
+/* Whether new queues carve their elements from an arena */
+static int arena = 0;
+
+/* Layout of queues created by a plain 'new', one of Q_LAYOUT_* */
+static int layout = Q_LAYOUT_LIST;
+
+/* Sort engine used by q_sort, one of Q_SORT_* */
+static int sortalgo = Q_SORT_AUTO;
+
+/* Number of threads the parallel sort may use */
+static int sort_threads = 1;
+
+/* Whether ascend and descend free the removed nodes in one batch */
+static int batch_free = 0;
+
+/* Whether inserted strings are interned, so equal ones share one copy */
+static int intern = 0;
+
+/* Bookkeeping level of the allocation harness, one of harness_mode_t */
+static int harness_level = HARNESS_FULL;
+
 #define MIN_RANDSTR_LEN 5
 #define MAX_RANDSTR_LEN 10
 static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
@@ -101,9 +125,6 @@ static bool do_free(int argc, char *argv[])
     }
     error_check();
 
-    if (current && current->size > BIG_LIST_SIZE)
-        set_cautious_mode(false);
-
     struct list_head *qnext = NULL;
     if (chain.size > 1) {
         qnext = (current->chain.next == &chain.head) ? chain.head.next
@@ -116,7 +137,6 @@ static bool do_free(int argc, char *argv[])
         if (exception_setup(true))
             q_free(current->q);
         exception_cancel();
-        set_cautious_mode(true);
     }
 
     if (current) {
@@ -130,8 +150,9 @@ static bool do_free(int argc, char *argv[])
     size_t bcnt = allocation_check();
     if (!chain.size && bcnt > 0) {
         report(1,
-               "ERROR: There is no queue, but %lu blocks are still allocated",
-               bcnt);
+               "ERROR: There is no queue, but %lu blocks (%lu bytes) are still "
+               "allocated",
+               bcnt, allocation_bytes());
         ok = false;
     }
 
@@ -140,8 +161,13 @@ static bool do_free(int argc, char *argv[])
 
 static bool do_new(int argc, char *argv[])
 {
-    if (argc != 1) {
-        report(1, "%s takes no arguments", argv[0]);
+    int kind = layout;
+    if (argc == 2 && !strcmp(argv[1], "ring")) {
+        kind = Q_LAYOUT_RING;
+    } else if (argc == 2 && !strcmp(argv[1], "unrolled")) {
+        kind = Q_LAYOUT_UNROLLED;
+    } else if (argc != 1) {
+        report(1, "%s takes no arguments, 'ring' or 'unrolled'", argv[0]);
         return false;
     }
 
@@ -152,7 +178,10 @@ static bool do_new(int argc, char *argv[])
         list_add_tail(&qctx->chain, &chain.head);
 
         qctx->size = 0;
-        qctx->q = q_new();
+        qctx->q = kind == Q_LAYOUT_RING       ? q_new_ring()
+                  : kind == Q_LAYOUT_UNROLLED ? q_new_unrolled()
+                  : arena                     ? q_new_arena()
+                                              : q_new();
         qctx->id = chain.size++;
 
         current = qctx;
@@ -163,6 +192,114 @@ static bool do_new(int argc, char *argv[])
     return ok && !error_check();
 }
 
+/* Write every queue of the chain to a snapshot file */
+static bool do_save(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s takes 1 argument", argv[0]);
+        return false;
+    }
+
+    /* Queues loaded from the file map their strings from it, so the file is
+     * replaced by a complete new one rather than truncated under them.
+     */
+    char tmp[PATH_MAX];
+    int fd = -1;
+    if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", argv[1]) < (int) sizeof(tmp))
+        fd = mkstemp(tmp);
+    FILE *f = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    if (!f) {
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp);
+        }
+        report(1, "ERROR: Could not open '%s' for writing", argv[1]);
+        return false;
+    }
+
+    q_snapshot_header_t hdr = {
+        .magic = Q_SNAPSHOT_MAGIC,
+        .version = Q_SNAPSHOT_VERSION,
+        .queues = chain.size,
+    };
+    bool ok = false;
+    if (fwrite(&hdr, sizeof(hdr), 1, f) == 1 && exception_setup(true)) {
+        bool saved = true;
+        queue_contex_t *qctx;
+        list_for_each_entry(qctx, &chain.head, chain) {
+            if (!(saved = q_save(qctx->q, f)))
+                break;
+        }
+        ok = saved;
+    }
+    exception_cancel();
+    if (fclose(f))
+        ok = false;
+    if (ok && rename(tmp, argv[1]))
+        ok = false;
+    if (!ok)
+        unlink(tmp);
+
+    if (!ok)
+        report(1, "ERROR: Could not save queues to '%s'", argv[1]);
+    return ok && !error_check();
+}
+
+/* Append the queues of a snapshot file to the chain */
+static bool do_load(int argc, char *argv[])
+{
+    bool drop = argc == 3 && !strcmp(argv[2], "remove");
+    if (argc != 2 && !drop) {
+        report(1, "%s takes 1 argument, optionally followed by 'remove'",
+               argv[0]);
+        return false;
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    if (fd < 0) {
+        report(1, "ERROR: Could not open '%s'", argv[1]);
+        return false;
+    }
+
+    q_snapshot_header_t hdr;
+    if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        hdr.magic != Q_SNAPSHOT_MAGIC || hdr.version != Q_SNAPSHOT_VERSION) {
+        report(1, "ERROR: '%s' is not a queue snapshot", argv[1]);
+        close(fd);
+        return false;
+    }
+
+    bool ok = true;
+    off_t pos = sizeof(hdr);
+    for (uint32_t i = 0; i < hdr.queues; i++) {
+        struct list_head *q = NULL;
+        if (exception_setup(true))
+            q = q_load(fd, &pos);
+        exception_cancel();
+        if (!q) {
+            report(1, "ERROR: Could not load queue %u of '%s'", i, argv[1]);
+            ok = false;
+            break;
+        }
+
+        queue_contex_t *qctx = malloc(sizeof(queue_contex_t));
+        list_add_tail(&qctx->chain, &chain.head);
+        qctx->q = q;
+        qctx->size = q_size(q);
+        qctx->id = chain.size++;
+        current = qctx;
+    }
+    close(fd);
+    /* The loaded queues keep their private mapping of the removed file */
+    if (drop && unlink(argv[1])) {
+        report(1, "ERROR: Could not remove '%s'", argv[1]);
+        ok = false;
+    }
+    q_show(3);
+
+    return ok && !error_check();
+}
+
 /* TODO: Add a buf_size check of if the buf_size may be less
  * than MIN_RANDSTR_LEN.
  */
@@ -180,6 +317,68 @@ static void fill_rand_string(char *buf, size_t buf_size)
     buf[len] = '\0';
 }
 
+/* Number of random strings generated per bulk insertion */
+#define RAND_BATCH 1024
+
+/* Insert reps copies of s, or reps random strings, through the bulk insertion
+ * API. Return the number of elements inserted before an allocation failed,
+ * and clear ok if the inserted strings are not separate copies.
+ */
+static int queue_insert_bulk(position_t pos,
+                             char *s,
+                             int reps,
+                             bool need_rand,
+                             bool *ok)
+{
+    static char randstr[RAND_BATCH][MAX_RANDSTR_LEN];
+    static char *randsv[RAND_BATCH];
+    int done = 0;
+
+    while (done < reps) {
+        char **sv = &s;
+        int n = reps - done, nstr = 1;
+
+        if (need_rand) {
+            n = n < RAND_BATCH ? n : RAND_BATCH;
+            for (int i = 0; i < n; i++) {
+                fill_rand_string(randstr[i], sizeof(randstr[i]));
+                randsv[i] = randstr[i];
+            }
+            sv = randsv;
+            nstr = n;
+        }
+
+        bool rval = pos == POS_TAIL ? q_insert_tail_n(current->q, sv, nstr, n)
+                                    : q_insert_head_n(current->q, sv, nstr, n);
+        if (!rval)
+            break;
+        current->size += n;
+        done += n;
+    }
+
+    /* Check the copies next to the inserting end, like the loop in
+     * queue_insert() does for the first two insertions.
+     */
+    if (done > 1) {
+        char *v0 = q_peek(current->q, pos == POS_TAIL ? -1 : 0)->value;
+        char *v1 = q_peek(current->q, pos == POS_TAIL ? -2 : 1)->value;
+
+        if (v0 == s || v1 == s) {
+            report(1,
+                   "ERROR: Need to allocate and copy string for new queue "
+                   "element");
+            *ok = false;
+        } else if (v0 == v1 && !intern) {
+            report(1,
+                   "ERROR: Need to allocate separate string for each queue "
+                   "element");
+            *ok = false;
+        }
+    }
+
+    return done;
+}
+
 /* insertion */
 static bool queue_insert(position_t pos, int argc, char *argv[])
 {
@@ -227,7 +426,15 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
     error_check();
 
     if (current && exception_setup(true)) {
-        for (int r = 0; ok && r < reps; r++) {
+        int r = 0;
+
+        /* Large repetitions go through the bulk API, and one element at a
+         * time from where it failed to allocate
+         */
+        if (reps > BIG_LIST_SIZE)
+            r = queue_insert_bulk(pos, inserts, reps, need_rand, &ok);
+
+        for (; ok && r < reps; r++) {
             if (need_rand)
                 fill_rand_string(randstr_buf, sizeof(randstr_buf));
             bool rval = pos == POS_TAIL ? q_insert_tail(current->q, inserts)
@@ -235,9 +442,7 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
             if (rval) {
                 current->size++;
                 element_t *entry =
-                    pos == POS_TAIL
-                        ? list_last_entry(current->q, element_t, list)
-                        : list_first_entry(current->q, element_t, list);
+                    q_peek(current->q, pos == POS_TAIL ? -1 : 0);
                 char *cur_inserts = entry->value;
                 if (!cur_inserts) {
                     report(1, "ERROR: Failed to save copy of string in queue");
@@ -248,7 +453,7 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
                            "queue element");
                     ok = false;
                     break;
-                } else if (r == 1 && lasts == cur_inserts) {
+                } else if (r == 1 && lasts == cur_inserts && !intern) {
                     report(1,
                            "ERROR: Need to allocate separate string for each "
                            "queue element");
@@ -296,12 +501,27 @@ static bool queue_remove(position_t pos, int argc, char *argv[])
      */
 #if !(defined(__aarch64__) && defined(__APPLE__))
     if (simulation) {
-        if (argc != 1) {
+        int batch = 0;
+        /* "*" leaves the string uncopied, as outside simulation mode */
+        bool detach = argc == 2 && !strcmp(argv[1], "*");
+        if (pos == POS_HEAD && argc == 2 && !detach) {
+            if (!get_int(argv[1], &batch) || batch < 1) {
+                report(1, "Invalid number of removals '%s'", argv[1]);
+                return false;
+            }
+            set_dut_batch(batch);
+        } else if (argc != 1 && !detach) {
             report(1, "%s does not need arguments in simulation mode", argv[0]);
             return false;
         }
-        bool ok =
-            pos == POS_TAIL ? is_remove_tail_const() : is_remove_head_const();
+        bool ok;
+        if (detach)
+            ok = pos == POS_TAIL ? is_detach_tail_const()
+                                 : is_detach_head_const();
+        else
+            ok = pos == POS_TAIL ? is_remove_tail_const()
+                 : batch         ? is_remove_head_n_const()
+                                 : is_remove_head_const();
         if (!ok) {
             report(1,
                    "ERROR: Probably not constant time or wrong implementation");
@@ -332,7 +552,9 @@ static bool queue_remove(position_t pos, int argc, char *argv[])
         return false;
     }
 
-    bool check = argc > 1;
+    /* With "*" the removed string is not needed and is left uncopied */
+    bool check = argc > 1 && strcmp(argv[1], "*");
+    bool zero_copy = argc > 1 && !check;
     bool ok = true;
     if (check) {
         strncpy(checks, argv[1], string_length + 1);
@@ -349,15 +571,31 @@ static bool queue_remove(position_t pos, int argc, char *argv[])
     error_check();
 
     element_t *re = NULL;
-    if (current && exception_setup(true))
-        re = pos == POS_TAIL
-                 ? q_remove_tail(current->q, removes, string_length + 1)
-                 : q_remove_head(current->q, removes, string_length + 1);
+    if (current && exception_setup(true)) {
+        if (zero_copy)
+            re = pos == POS_TAIL ? q_detach_tail(current->q)
+                                 : q_detach_head(current->q);
+        else
+            re = pos == POS_TAIL
+                     ? q_remove_tail(current->q, removes, string_length + 1)
+                     : q_remove_head(current->q, removes, string_length + 1);
+    }
     exception_cancel();
 
     bool is_null = re ? false : true;
 
-    if (!is_null) {
+    if (!is_null && zero_copy) {
+        char *value = q_take_value(re);
+        if (!value) {
+            report(1, "ERROR: Failed to take removed value");
+            q_release_element(re);
+            ok = false;
+        } else {
+            report(2, "Removed %s from queue", value);
+            test_free(value);
+        }
+        current->size--;
+    } else if (!is_null) {
         // q_remove_head and q_remove_tail are not responsible for releasing
         // node
         q_release_element(re);
@@ -407,8 +645,84 @@ static bool queue_remove(position_t pos, int argc, char *argv[])
     return ok && !error_check();
 }
 
+/* Number of elements removed per q_remove_head_copy_n() call by 'rh str n' */
+#define REMOVE_BATCH 1024
+
+/* Remove n elements from head in batches, comparing each of them to checks
+ * unless it is "*"
+ */
+static bool queue_remove_head_n(char *checks, int n)
+{
+    size_t bufsize = (size_t) REMOVE_BATCH * (string_length + 1);
+    char *buf = malloc(bufsize);
+    size_t *offsets = malloc(REMOVE_BATCH * sizeof(size_t));
+    bool check = strcmp(checks, "*"), ok = true;
+
+    if (!buf || !offsets) {
+        report(1,
+               "INTERNAL ERROR.  Could not allocate space for removed strings");
+        free(buf);
+        free(offsets);
+        return false;
+    }
+
+    if (!current || !current->size)
+        report(3, "Warning: Calling remove head on empty queue");
+    error_check();
+
+    while (ok && n > 0) {
+        LIST_HEAD(removed);
+        int want = n < REMOVE_BATCH ? n : REMOVE_BATCH, got = 0;
+
+        /* Nothing to compare against, so the strings need not be copied */
+        if (current && exception_setup(true))
+            got = check ? q_remove_head_copy_n(current->q, &removed, want, buf,
+                                               bufsize, offsets)
+                        : q_remove_head_n(current->q, &removed, want);
+        exception_cancel();
+
+        element_t *item, *tmp;
+        int cnt = 0;
+        list_for_each_entry_safe(item, tmp, &removed, list) {
+            if (check && strcmp(buf + offsets[cnt], checks)) {
+                report(1, "ERROR: Removed value %s != expected value %s",
+                       buf + offsets[cnt], checks);
+                ok = false;
+            }
+            q_release_element(item);
+            cnt++;
+        }
+
+        if (cnt != got) {
+            report(1, "ERROR: Removed %d elements but reported %d", cnt, got);
+            ok = false;
+        }
+        if (!got) {
+            report(1, "ERROR: Removal from queue failed");
+            ok = false;
+        }
+        if (current)
+            current->size -= cnt;
+        n -= got;
+    }
+
+    q_show(3);
+
+    free(buf);
+    free(offsets);
+    return ok && !error_check();
+}
+
 static inline bool do_rh(int argc, char *argv[])
 {
+    if (argc == 3 && !simulation) {
+        int n;
+        if (!get_int(argv[2], &n) || n < 1) {
+            report(1, "Invalid number of removals '%s'", argv[2]);
+            return false;
+        }
+        return queue_remove_head_n(argv[1], n);
+    }
     return queue_remove(POS_HEAD, argc, argv);
 }
 
@@ -433,6 +747,7 @@ static bool do_dedup(int argc, char *argv[])
     element_t *item = NULL, *tmp = NULL;
 
     // Copy current->q to l_copy
+    q_link(current->q);
     if (current->q && !list_empty(current->q)) {
         list_for_each_entry(item, current->q, list) {
             size_t slen;
@@ -476,6 +791,7 @@ static bool do_dedup(int argc, char *argv[])
         return false;
     }
 
+    q_link(current->q);
     struct list_head *l_tmp = current->q->next;
     bool is_this_dup = false;
     // Compare between new list and old one
@@ -576,7 +892,271 @@ static bool do_size(int argc, char *argv[])
     return ok && !error_check();
 }
 
-bool do_sort(int argc, char *argv[])
+/* Queue of 64-bit keys, exercised by the keys command */
+DECLARE_QUEUE(keyq, uint64_t, typed_queue_cmp_scalar)
+
+/* Check that the keys are ordered as requested, strictly when @strict */
+static bool keyq_check(struct keyq *kq, bool strict)
+{
+    struct list_head *node;
+    list_for_each (node, &kq->head) {
+        if (node->next == &kq->head)
+            break;
+        uint64_t a = *keyq_value(node), b = *keyq_value(node->next);
+        if (descend ? a < b : a > b) {
+            report(1, "ERROR: Keys not sorted in %s order",
+                   descend ? "descending" : "ascending");
+            return false;
+        }
+        if (strict && a == b) {
+            report(1, "ERROR: Duplicate key %llu left in queue",
+                   (unsigned long long) a);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool do_keys(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s takes 1 argument", argv[0]);
+        return false;
+    }
+
+    int cnt;
+    if (!get_int(argv[1], &cnt) || cnt < 1) {
+        report(1, "Invalid number of keys '%s'", argv[1]);
+        return false;
+    }
+
+    struct keyq *kq = keyq_new();
+    bool ok = kq;
+    /* Draw the keys from a range about the size of the queue, so that sorting
+     * has to keep equal keys together and deleting duplicates has work to do
+     */
+    for (int i = 0; ok && i < cnt; i++) {
+        uint64_t key;
+        randombytes((uint8_t *) &key, sizeof(key));
+        ok = keyq_insert_tail(kq, key % (uint64_t) cnt);
+    }
+    if (!ok) {
+        report(1, "ERROR: Could not allocate %d keys", cnt);
+        keyq_free(kq);
+        return false;
+    }
+
+    error_check();
+    set_noallocate_mode(true);
+    if (exception_setup(true))
+        keyq_sort(kq, descend);
+    exception_cancel();
+    set_noallocate_mode(false);
+
+    ok = keyq_size(kq) == cnt && keyq_check(kq, false);
+    if (ok) {
+        keyq_delete_dup(kq);
+        ok = keyq_check(kq, true);
+    }
+    if (ok)
+        report(2, "Sorted %d keys, %d without duplicates", cnt, keyq_size(kq));
+
+    keyq_free(kq);
+    return ok && !error_check();
+}
+
+/* Most producer or consumer threads the mt command starts */
+#define MT_MAX_THREADS 64
+
+/* How long a consumer waits before checking whether the producers are done */
+#define MT_WAIT_MS 100
+
+/* State shared by the threads of the mt command */
+typedef struct {
+    cqueue_t *cq;
+    int producers;
+    int total;    /* elements still expected, dropped on failed insertions */
+    int claimed;  /* elements claimed by consumers so far */
+    int finished; /* producers done inserting */
+    bool ok;
+} mt_state_t;
+
+typedef struct {
+    mt_state_t *state;
+    int id;
+    int count;
+    pthread_t tid;
+} mt_worker_t;
+
+/* Insert the strings "id:0" to "id:count-1" in order */
+static void *mt_produce(void *arg)
+{
+    mt_worker_t *w = arg;
+    char buf[32];
+
+    for (int i = 0; i < w->count; i++) {
+        snprintf(buf, sizeof(buf), "%d:%d", w->id, i);
+        if (!cq_insert_tail(w->state->cq, buf))
+            __atomic_sub_fetch(&w->state->total, 1, __ATOMIC_SEQ_CST);
+    }
+    __atomic_add_fetch(&w->state->finished, 1, __ATOMIC_SEQ_CST);
+    return NULL;
+}
+
+/* Remove elements until all are claimed, checking that the elements of each
+ * producer come out in the order they were inserted
+ */
+static void *mt_consume(void *arg)
+{
+    mt_worker_t *w = arg;
+    mt_state_t *state = w->state;
+    int last[MT_MAX_THREADS];
+    char buf[32];
+
+    for (int i = 0; i < state->producers; i++)
+        last[i] = -1;
+
+    for (;;) {
+        /* Every claim below the total is matched by one element */
+        int ticket = __atomic_fetch_add(&state->claimed, 1, __ATOMIC_SEQ_CST);
+        if (ticket >= __atomic_load_n(&state->total, __ATOMIC_SEQ_CST))
+            return NULL;
+
+        element_t *ele;
+        while (!(ele = cq_remove_head_wait(state->cq, buf, sizeof(buf),
+                                           MT_WAIT_MS))) {
+            /* Failed insertions lower the total after elements were claimed */
+            if (__atomic_load_n(&state->finished, __ATOMIC_SEQ_CST) >=
+                    state->producers &&
+                !cq_size(state->cq))
+                return NULL;
+        }
+
+        int id, seq;
+        if (sscanf(buf, "%d:%d", &id, &seq) != 2 || id < 0 ||
+            id >= state->producers || seq <= last[id]) {
+            report(1, "ERROR: Consumer %d got '%s' out of order", w->id, buf);
+            __atomic_store_n(&state->ok, false, __ATOMIC_RELAXED);
+        } else {
+            last[id] = seq;
+        }
+        cq_release_element(ele);
+        w->count++;
+    }
+}
+
+static bool do_mt(int argc, char *argv[])
+{
+    if (argc != 4) {
+        report(1, "%s takes 3 arguments", argv[0]);
+        return false;
+    }
+
+    int producers, consumers, cnt;
+    if (!get_int(argv[1], &producers) || producers < 1 ||
+        producers > MT_MAX_THREADS || !get_int(argv[2], &consumers) ||
+        consumers < 1 || consumers > MT_MAX_THREADS) {
+        report(1, "Thread counts must be between 1 and %d", MT_MAX_THREADS);
+        return false;
+    }
+    if (!get_int(argv[3], &cnt) || cnt < 0) {
+        report(1, "Invalid number of elements '%s'", argv[3]);
+        return false;
+    }
+
+    mt_state_t state = {
+        .cq = cq_new(),
+        .producers = producers,
+        .total = cnt,
+        .claimed = 0,
+        .finished = 0,
+        .ok = true,
+    };
+    if (!state.cq) {
+        report(1, "ERROR: Could not allocate concurrent queue");
+        return false;
+    }
+
+    mt_worker_t workers[2 * MT_MAX_THREADS];
+    int nr = producers + consumers;
+    for (int i = 0; i < nr; i++) {
+        workers[i].state = &state;
+        workers[i].id = i < producers ? i : i - producers;
+        workers[i].count = 0;
+        if (i < producers)
+            workers[i].count = cnt / producers + (i < cnt % producers);
+    }
+
+    /* The workers leave the time limit to the main thread */
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGALRM);
+
+    double start = 0;
+    delta_time(&start);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    int started = 0;
+    for (; started < nr; started++) {
+        /* Start the consumers first, so that they have to wait */
+        mt_worker_t *w = &workers[(started + producers) % nr];
+        if (pthread_create(&w->tid, NULL,
+                           w < workers + producers ? mt_produce : mt_consume,
+                           w))
+            break;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (started < nr) {
+        /* Let the consumers that did start stop once the queue is drained */
+        report(1, "ERROR: Could not start thread %d", started);
+        __atomic_store_n(&state.total, 0, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&state.finished, producers, __ATOMIC_SEQ_CST);
+        state.ok = false;
+    }
+    for (int i = 0; i < started; i++)
+        pthread_join(workers[(i + producers) % nr].tid, NULL);
+    double elapsed = delta_time(&start);
+
+    int removed = 0;
+    for (int i = producers; i < nr; i++)
+        removed += workers[i].count;
+    if (started == nr && (removed != state.total || cq_size(state.cq))) {
+        report(1, "ERROR: Inserted %d elements, removed %d, %d left",
+               state.total, removed, cq_size(state.cq));
+        state.ok = false;
+    }
+
+    report(1,
+           "%d producers, %d consumers: %d elements in %.3f s, %.0f ops/sec",
+           producers, consumers, removed, elapsed,
+           elapsed > 0 ? 2.0 * removed / elapsed : 0.0);
+    report(2, "Contention: head lock %lu, tail lock %lu, waits %lu",
+           state.cq->head_contended, state.cq->tail_contended,
+           state.cq->waits);
+
+    cq_free(state.cq);
+    return state.ok && !error_check();
+}
+
+/* Orders used by the reference sort */
+static int cmp_ascend(void *priv,
+                      const struct list_head *a,
+                      const struct list_head *b)
+{
+    return strcmp(list_entry(a, element_t, list)->value,
+                  list_entry(b, element_t, list)->value);
+}
+
+static int cmp_descend(void *priv,
+                       const struct list_head *a,
+                       const struct list_head *b)
+{
+    return cmp_ascend(priv, b, a);
+}
+
+/* Sort the current queue with q_sort(), or with list_sort() as a reference,
+ * and check the result
+ */
+static bool queue_sort(int argc, char *argv[], bool reference)
 {
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
@@ -594,6 +1174,12 @@ bool do_sort(int argc, char *argv[])
         report(3, "Warning: Calling sort on single node");
     error_check();
 
+    /* q_sort must not allocate, so hand it working memory beforehand */
+    size_t scratch_size = q_sort_scratch_size(cnt);
+    void *scratch = scratch_size ? malloc(scratch_size) : NULL;
+    if (scratch)
+        q_sort_set_scratch(scratch, scratch_size);
+
     set_noallocate_mode(true);
 
 /* If the number of elements is too large, it may take a long time to check the
@@ -602,6 +1188,8 @@ bool do_sort(int argc, char *argv[])
 #define MAX_NODES 100000
     struct list_head *nodes[MAX_NODES];
     unsigned no = 0;
+    if (current)
+        q_link(current->q);
     if (current && current->size && current->size <= MAX_NODES) {
         element_t *entry;
         list_for_each_entry(entry, current->q, list)
@@ -612,13 +1200,24 @@ bool do_sort(int argc, char *argv[])
                "number of elements %d is too large, exceeds the limit %d.",
                current->size, MAX_NODES);
 
-    if (current && exception_setup(true))
-        q_sort(current->q, descend);
+    if (current && exception_setup(true)) {
+        if (!reference)
+            q_sort(current->q, descend);
+        else if (current->q) {
+            list_sort(NULL, current->q, descend ? cmp_descend : cmp_ascend);
+            /* The nodes were rearranged behind the back of the queue */
+            q_size_adjust(current->q, 0);
+        }
+    }
     exception_cancel();
     set_noallocate_mode(false);
 
+    q_sort_set_scratch(NULL, 0);
+    free(scratch);
+
     bool ok = true;
     if (current && current->size) {
+        q_link(current->q);
         for (struct list_head *cur_l = current->q->next;
              cur_l != current->q && --cnt; cur_l = cur_l->next) {
             /* Ensure each element in ascending/descending order */
@@ -667,6 +1266,16 @@ bool do_sort(int argc, char *argv[])
     return ok && !error_check();
 }
 
+bool do_sort(int argc, char *argv[])
+{
+    return queue_sort(argc, argv, false);
+}
+
+static bool do_lsort(int argc, char *argv[])
+{
+    return queue_sort(argc, argv, true);
+}
+
 static bool do_dm(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -747,6 +1356,7 @@ static bool do_ascend(int argc, char *argv[])
 
     cnt = current->size;
     if (current->size) {
+        q_link(current->q);
         for (struct list_head *cur_l = current->q->next;
              cur_l != current->q && --cnt; cur_l = cur_l->next) {
             element_t *item, *next_item;
@@ -794,6 +1404,7 @@ static bool do_descend(int argc, char *argv[])
 
     cnt = current->size;
     if (current->size) {
+        q_link(current->q);
         for (struct list_head *cur_l = current->q->next;
              cur_l != current->q && --cnt; cur_l = cur_l->next) {
             element_t *item, *next_item;
@@ -862,7 +1473,7 @@ static bool do_merge(int argc, char *argv[])
     exception_cancel();
     set_noallocate_mode(false);
 
-    if (q_size(&chain.head) > 1) {
+    if (chain.size > 1) {
         chain.size = 1;
         current = list_entry(chain.head.next, queue_contex_t, chain);
         current->size = len;
@@ -881,6 +1492,7 @@ static bool do_merge(int argc, char *argv[])
 
     bool ok = true;
     if (current && current->size) {
+        q_link(current->q);
         for (struct list_head *cur_l = current->q->next;
              cur_l != current->q && --len; cur_l = cur_l->next) {
             /* Ensure each element in ascending order */
@@ -949,6 +1561,7 @@ static bool q_show(int vlevel)
         return true;
     }
 
+    q_link(current->q);
     if (!is_circular()) {
         report(vlevel, "ERROR:  Queue is not doubly circular");
         return false;
@@ -962,12 +1575,13 @@ static bool q_show(int vlevel)
     if (exception_setup(true)) {
         while (ok && ori != cur && cnt < current->size) {
             element_t *e = list_entry(cur, element_t, list);
+            list_prefetch(cur->next->next);
             if (cnt < BIG_LIST_SIZE) {
                 report_noreturn(vlevel, cnt == 0 ? "%s" : " %s", e->value);
                 if (show_entropy) {
                     report_noreturn(
                         vlevel, "(%3.2f%%)",
-                        shannon_entropy((const uint8_t *) e->value));
+                        shannon_entropy((const uint8_t *) e->value, e->len));
                 }
             }
             cnt++;
@@ -1056,10 +1670,63 @@ static bool do_next(int argc, char *argv[])
     return q_show(0);
 }
 
+static void set_sortalgo(int oldval)
+{
+    if (!q_sort_set_engine(sortalgo)) {
+        report(1, "Unknown sort engine %d", sortalgo);
+        sortalgo = oldval;
+    }
+}
+
+static void set_layout(int oldval)
+{
+    if (layout < Q_LAYOUT_LIST || layout > Q_LAYOUT_UNROLLED) {
+        report(1, "Unknown queue layout %d", layout);
+        layout = oldval;
+    }
+}
+
+static void set_sort_threads(int oldval)
+{
+    if (!q_sort_set_threads(sort_threads)) {
+        report(1, "Thread count must be between 1 and %d",
+               Q_SORT_MAX_THREADS);
+        sort_threads = oldval;
+    }
+}
+
+static void set_batch_free(int oldval)
+{
+    q_set_batch_free(batch_free);
+}
+
+static void set_intern(int oldval)
+{
+    q_set_intern(intern);
+}
+
+static void set_harness_level(int oldval)
+{
+    if (!set_harness_mode(harness_level)) {
+        report(1,
+               "Harness level must be 0, 1 or 2, and can only change while no "
+               "block is allocated");
+        harness_level = oldval;
+    }
+}
+
 static void console_init()
 {
-    ADD_COMMAND(new, "Create new queue", "");
+    ADD_COMMAND(new,
+                "Create new queue, backed by a ring or unrolled blocks if "
+                "asked",
+                "[ring|unrolled]");
     ADD_COMMAND(free, "Delete queue", "");
+    ADD_COMMAND(save, "Save all queues to snapshot file", "file");
+    ADD_COMMAND(load,
+                "Add the queues of snapshot file, mapping their strings "
+                "from it, and remove the file if asked",
+                "file [remove]");
     ADD_COMMAND(prev, "Switch to previous queue", "");
     ADD_COMMAND(next, "Switch to next queue", "");
     ADD_COMMAND(ih,
@@ -1070,16 +1737,28 @@ static void console_init()
                 "Insert string str at tail of queue n times. Generate random "
                 "string(s) if str equals RAND. (default: n == 1)",
                 "str [n]");
-    ADD_COMMAND(
-        rh,
-        "Remove from head of queue. Optionally compare to expected value str",
-        "[str]");
+    ADD_COMMAND(rh,
+                "Remove from head of queue n times. Optionally compare to "
+                "expected value str, '*' matches any value. (default: n == 1)",
+                "[str [n]]");
     ADD_COMMAND(
         rt,
         "Remove from tail of queue. Optionally compare to expected value str",
         "[str]");
     ADD_COMMAND(reverse, "Reverse queue", "");
     ADD_COMMAND(sort, "Sort queue in ascending/descending order", "");
+    ADD_COMMAND(mt,
+                "Stress a concurrent queue with p producer and c consumer "
+                "threads passing n elements",
+                "p c n");
+    ADD_COMMAND(keys,
+                "Sort n random 64-bit keys in a typed queue and delete "
+                "duplicates",
+                "n");
+    ADD_COMMAND(lsort,
+                "Sort queue in ascending/descending order with list_sort() "
+                "as a reference",
+                "");
     ADD_COMMAND(size, "Compute queue size n times (default: n == 1)", "[n]");
     ADD_COMMAND(show, "Show queue contents", "");
     ADD_COMMAND(dm, "Delete middle node in queue", "");
@@ -1104,6 +1783,27 @@ static void console_init()
               "Number of times allow queue operations to return false", NULL);
     add_param("descend", &descend,
               "Sort and merge queue in ascending/descending order", NULL);
+    add_param("arena", &arena,
+              "Carve elements of newly created queues from an arena", NULL);
+    add_param("layout", &layout,
+              "Layout of newly created queues: 0 = list, 1 = ring, "
+              "2 = unrolled",
+              set_layout);
+    add_param("sortalgo", &sortalgo,
+              "Sort engine: 0 = auto, 1 = list, 2 = key prefix, 3 = radix, "
+              "4 = parallel",
+              set_sortalgo);
+    add_param("threads", &sort_threads, "Number of threads used by sort",
+              set_sort_threads);
+    add_param("batchfree", &batch_free,
+              "Free nodes removed by ascend/descend in one batch",
+              set_batch_free);
+    add_param("intern", &intern,
+              "Share one copy of equal strings between queue elements",
+              set_intern);
+    add_param("harness", &harness_level,
+              "Allocation checking: 0 = full, 1 = counting, 2 = off",
+              set_harness_level);
 }
 
 /* Signal handlers */
@@ -1136,8 +1836,6 @@ static void q_init()
 static bool q_quit(int argc, char *argv[])
 {
     report(3, "Freeing queue");
-    if (current && current->size > BIG_LIST_SIZE)
-        set_cautious_mode(false);
 
     if (exception_setup(true)) {
         struct list_head *cur = chain.head.next;
@@ -1151,12 +1849,13 @@ static bool q_quit(int argc, char *argv[])
     }
 
     exception_cancel();
-    set_cautious_mode(true);
 
     size_t bcnt = allocation_check();
     if (bcnt > 0) {
-        report(1, "ERROR: Freed queue, but %lu blocks are still allocated",
-               bcnt);
+        report(1,
+               "ERROR: Freed queue, but %lu blocks (%lu bytes) are still "
+               "allocated",
+               bcnt, allocation_bytes());
         return false;
     }
 
@@ -1,368 +1,2451 @@
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "queue.h"
 
+/* Payload size of a regular arena chunk */
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+/* Arena carving granularity, keeps every element_t suitably aligned */
+#define ARENA_ALIGN(n) \
+    (((n) + sizeof(void *) - 1) & ~(size_t) (sizeof(void *) - 1))
+
+/* Capacity of the first ring allocated for a ring queue */
+#define RING_MIN_CAP 16
+
+/* Block of element pointers of an unrolled queue, in use from lo to hi */
+typedef struct {
+    struct list_head list;
+    unsigned int lo, hi;
+    element_t *ele[Q_BLOCK_LEN];
+} q_block_t;
+
+/* Position of an element in the ring or in the blocks of a queue */
+typedef struct {
+    q_block_t *block; /* NULL in a ring */
+    unsigned int i;   /* index into the block, or unwrapped into the ring */
+} slot_pos_t;
+
+/* Block of memory that arena elements are carved from */
+typedef struct {
+    struct list_head list;
+    size_t used, cap;
+    void *map;      /* snapshot mapped by q_load(), unmapped with the chunk */
+    size_t map_len;
+    char data[];
+} arena_chunk_t;
+
+static inline queue_head_t *q_header(struct list_head *head)
+{
+    return list_entry(head, queue_head_t, head);
+}
+
+/* Pack the first 8 bytes of s so that integer order matches strcmp() */
+static inline uint64_t str_key(const char *s)
+{
+    uint64_t key = 0;
+    for (int i = 0; i < 8; i++) {
+        unsigned char c = *s;
+        key = key << 8 | c;
+        s += !!c;
+    }
+    return key;
+}
+
+/* Fill in the cached length and prefix of ele, whose value holds len bytes
+ * including the terminating null byte
+ */
+static inline void element_cache(element_t *ele, size_t len)
+{
+    ele->len = len - 1;
+    ele->prefix = str_key(ele->value) >> 32;
+}
+
+/* Order two elements like strcmp() does, on the prefixes alone if they
+ * differ */
+static inline int element_cmp(const element_t *a, const element_t *b)
+{
+    if (a->prefix != b->prefix)
+        return a->prefix < b->prefix ? -1 : 1;
+    /* Both strings ended within the prefix */
+    if (!(a->prefix & 0xff))
+        return 0;
+    return strcmp(a->value + 4, b->value + 4);
+}
+
+/* Whether two elements hold equal strings */
+static inline bool element_eq(const element_t *a, const element_t *b)
+{
+    /* Equal interned strings are the same copy */
+    if (a->flags & b->flags & Q_ELEM_INTERNED)
+        return a->value == b->value;
+    if (a->len != b->len || a->prefix != b->prefix)
+        return false;
+    return a->len <= 4 || !memcmp(a->value + 4, b->value + 4, a->len - 4);
+}
+
+/* Copy the string of ele to sp, truncated to bufsize - 1 bytes */
+static inline void element_copy(const element_t *ele, char *sp, size_t bufsize)
+{
+    if (!sp)
+        return;
+
+    size_t n = ele->len;
+    if (bufsize - 1 < n)
+        n = bufsize - 1;
+    memcpy(sp, ele->value, n);
+    sp[n] = '\0';
+}
+
+/* Append the string of ele and its terminator to buf at *used, unless it does
+ * not fit entirely */
+static inline bool element_pack(const element_t *ele,
+                                char *buf,
+                                size_t bufsize,
+                                size_t *used)
+{
+    size_t len = ele->len;
+
+    if (len >= bufsize - *used)
+        return false;
+    memcpy(buf + *used, ele->value, len + 1);
+    *used += len + 1;
+    return true;
+}
+
+static inline element_t **ring_slot(queue_head_t *q, unsigned int i)
+{
+    return &q->slots[(q->first + i) & (q->cap - 1)];
+}
+
+/* Replace the ring of q by one of at least need slots, moving the elements
+ * over if keep is set */
+static bool ring_resize(queue_head_t *q, unsigned int need, bool keep)
+{
+    unsigned int cap = RING_MIN_CAP;
+    while (cap < need)
+        cap *= 2;
+
+    element_t **slots = malloc(cap * sizeof(element_t *));
+    if (!slots)
+        return false;
+    if (keep) {
+        for (unsigned int i = 0; i < (unsigned int) q->size; i++)
+            slots[i] = *ring_slot(q, i);
+    }
+    free(q->slots);
+    q->slots = slots;
+    q->cap = cap;
+    q->first = 0;
+    return true;
+}
+
+/* Make sure the spare list of an unrolled queue holds n blocks, allocating the
+ * missing ones if grow is set */
+static bool blocks_spare(queue_head_t *q, unsigned int n, bool grow)
+{
+    struct list_head *node;
+    unsigned int have = 0;
+
+    list_for_each (node, &q->spare) {
+        if (have >= n)
+            return true;
+        have++;
+    }
+    if (have >= n)
+        return true;
+    if (!grow)
+        return false;
+
+    for (; have < n; have++) {
+        q_block_t *block = malloc(sizeof(q_block_t));
+        if (!block)
+            return false;
+        list_add(&block->list, &q->spare);
+    }
+    return true;
+}
+
+/* Append a spare block to either end of an unrolled queue, empty and with all
+ * its room on the side facing away from the queue */
+static q_block_t *blocks_extend(queue_head_t *q, bool at_head)
+{
+    q_block_t *block = list_first_entry(&q->spare, q_block_t, list);
+
+    block->lo = block->hi = at_head ? Q_BLOCK_LEN : 0;
+    if (at_head)
+        list_move(&block->list, &q->blocks);
+    else
+        list_move_tail(&block->list, &q->blocks);
+    return block;
+}
+
+static inline slot_pos_t slot_first(queue_head_t *q)
+{
+    if (q->layout == Q_LAYOUT_RING)
+        return (slot_pos_t) {NULL, q->first};
+
+    q_block_t *block = list_first_entry(&q->blocks, q_block_t, list);
+    return (slot_pos_t) {block, block->lo};
+}
+
+static inline slot_pos_t slot_last(queue_head_t *q)
+{
+    if (q->layout == Q_LAYOUT_RING)
+        return (slot_pos_t) {NULL, q->first + q->size - 1};
+
+    q_block_t *block = list_last_entry(&q->blocks, q_block_t, list);
+    return (slot_pos_t) {block, block->hi - 1};
+}
+
+static inline element_t **slot_at(queue_head_t *q, slot_pos_t pos)
+{
+    return pos.block ? &pos.block->ele[pos.i]
+                     : &q->slots[pos.i & (q->cap - 1)];
+}
+
+/* Move pos to the next element. Past the last one, pos must not be used */
+static inline void slot_next(queue_head_t *q, slot_pos_t *pos)
+{
+    pos->i++;
+    if (pos->block && pos->i == pos->block->hi &&
+        pos->block->list.next != &q->blocks) {
+        pos->block = list_entry(pos->block->list.next, q_block_t, list);
+        pos->i = pos->block->lo;
+    }
+}
+
+/* Move pos to the previous element. Before the first one, pos must not be
+ * used */
+static inline void slot_prev(queue_head_t *q, slot_pos_t *pos)
+{
+    if (pos->block && pos->i == pos->block->lo &&
+        pos->block->list.prev != &q->blocks) {
+        pos->block = list_entry(pos->block->list.prev, q_block_t, list);
+        pos->i = pos->block->hi;
+    }
+    pos->i--;
+}
+
+/* Position of the i-th element, walking the blocks from the closer end */
+static slot_pos_t slot_find(queue_head_t *q, unsigned int i)
+{
+    if (q->layout == Q_LAYOUT_RING)
+        return (slot_pos_t) {NULL, q->first + i};
+
+    q_block_t *block;
+    if (i < (unsigned int) q->size / 2) {
+        list_for_each_entry(block, &q->blocks, list) {
+            if (i < block->hi - block->lo)
+                break;
+            i -= block->hi - block->lo;
+        }
+        return (slot_pos_t) {block, block->lo + i};
+    }
+
+    i = q->size - 1 - i;
+    block = list_last_entry(&q->blocks, q_block_t, list);
+    while (i >= block->hi - block->lo) {
+        i -= block->hi - block->lo;
+        block = list_entry(block->list.prev, q_block_t, list);
+    }
+    return (slot_pos_t) {block, block->hi - 1 - i};
+}
+
+/* Link the elements of a ring or unrolled queue in the order of its slots */
+void q_link(struct list_head *head)
+{
+    if (!head || q_header(head)->layout == Q_LAYOUT_LIST)
+        return;
+
+    queue_head_t *q = q_header(head);
+    if (!q->links_valid) {
+        struct list_head *prev = head;
+        slot_pos_t pos = q->size ? slot_first(q) : (slot_pos_t) {NULL, 0};
+        for (int i = 0; i < q->size; i++, slot_next(q, &pos)) {
+            struct list_head *node = &(*slot_at(q, pos))->list;
+            prev->next = node;
+            node->prev = prev;
+            prev = node;
+        }
+        prev->next = head;
+        head->prev = prev;
+        q->links_valid = true;
+    }
+}
+
+/* Link the elements of a ring or unrolled queue for the list version of an
+ * operation, which leaves the slots out of date */
+static void slots_leave(struct list_head *head)
+{
+    if (!head)
+        return;
+
+    q_link(head);
+    q_header(head)->slots_valid = false;
+}
+
+/* Return true if an operation can run on the ring or the blocks of q,
+ * rebuilding them from the list if needed, and growing them if allowed to.
+ * Otherwise the elements are linked, ready for the list version of the
+ * operation.
+ */
+static bool slots_ready(queue_head_t *q, bool grow)
+{
+    if (q->layout == Q_LAYOUT_LIST)
+        return false;
+    if (q->slots_valid)
+        return true;
+
+    element_t *ele;
+    if (q->layout == Q_LAYOUT_RING) {
+        if ((unsigned int) q->size > q->cap &&
+            (!grow || !ring_resize(q, q->size, false))) {
+            slots_leave(&q->head);
+            return false;
+        }
+
+        unsigned int i = 0;
+        list_for_each_entry(ele, &q->head, list)
+            q->slots[i++] = ele;
+        q->first = 0;
+    } else {
+        list_splice_init(&q->blocks, &q->spare);
+        if (!blocks_spare(q, (q->size + Q_BLOCK_LEN - 1) / Q_BLOCK_LEN,
+                          grow)) {
+            slots_leave(&q->head);
+            return false;
+        }
+
+        q_block_t *block = NULL;
+        list_for_each_entry(ele, &q->head, list) {
+            if (!block || block->hi == Q_BLOCK_LEN)
+                block = blocks_extend(q, false);
+            block->ele[block->hi++] = ele;
+        }
+    }
+    q->slots_valid = true;
+    return true;
+}
+
+/* Make room for n more elements at either end of a ring or unrolled queue */
+static bool slots_reserve(queue_head_t *q, unsigned int n, bool at_head)
+{
+    if (q->layout == Q_LAYOUT_RING)
+        return q->size + n <= q->cap || ring_resize(q, q->size + n, true);
+
+    unsigned int room = 0;
+    if (!list_empty(&q->blocks)) {
+        q_block_t *block =
+            at_head ? list_first_entry(&q->blocks, q_block_t, list)
+                    : list_last_entry(&q->blocks, q_block_t, list);
+        room = at_head ? block->lo : Q_BLOCK_LEN - block->hi;
+    }
+    return n <= room ||
+           blocks_spare(q, (n - room + Q_BLOCK_LEN - 1) / Q_BLOCK_LEN, true);
+}
+
+/* Put ele at either end of a ring or unrolled queue, which must have room
+ * for it, see slots_reserve() */
+static inline void slots_push(queue_head_t *q, element_t *ele, bool at_head)
+{
+    if (q->layout == Q_LAYOUT_RING) {
+        if (at_head) {
+            q->first = (q->first - 1) & (q->cap - 1);
+            q->slots[q->first] = ele;
+        } else {
+            *ring_slot(q, q->size) = ele;
+        }
+    } else if (at_head) {
+        q_block_t *block = list_empty(&q->blocks)
+                               ? NULL
+                               : list_first_entry(&q->blocks, q_block_t, list);
+        if (!block || !block->lo)
+            block = blocks_extend(q, true);
+        block->ele[--block->lo] = ele;
+    } else {
+        q_block_t *block = list_empty(&q->blocks)
+                               ? NULL
+                               : list_last_entry(&q->blocks, q_block_t, list);
+        if (!block || block->hi == Q_BLOCK_LEN)
+            block = blocks_extend(q, false);
+        block->ele[block->hi++] = ele;
+    }
+    q->size++;
+    q->links_valid = false;
+}
+
+/* Take the element at either end of a non-empty ring or unrolled queue */
+static inline element_t *slots_pop(queue_head_t *q, bool at_head)
+{
+    element_t *ele;
+
+    if (q->layout == Q_LAYOUT_RING) {
+        if (at_head) {
+            ele = q->slots[q->first];
+            q->first = (q->first + 1) & (q->cap - 1);
+        } else {
+            ele = *ring_slot(q, q->size - 1);
+        }
+    } else {
+        q_block_t *block = at_head
+                               ? list_first_entry(&q->blocks, q_block_t, list)
+                               : list_last_entry(&q->blocks, q_block_t, list);
+        ele = at_head ? block->ele[block->lo++] : block->ele[--block->hi];
+        if (block->lo == block->hi)
+            list_move(&block->list, &q->spare);
+    }
+    q->size--;
+    q->links_valid = false;
+    INIT_LIST_HEAD(&ele->list);
+    return ele;
+}
+
+/* Reverse the n elements from a to b of a ring or unrolled queue */
+static void slots_reverse(queue_head_t *q,
+                          slot_pos_t a,
+                          slot_pos_t b,
+                          unsigned int n)
+{
+    for (; n > 1; n -= 2) {
+        element_t **x = slot_at(q, a), **y = slot_at(q, b), *tmp = *x;
+        *x = *y;
+        *y = tmp;
+        slot_next(q, &a);
+        slot_prev(q, &b);
+    }
+    q->links_valid = false;
+}
+
+/* Reverse the elements of a ring or unrolled queue k at a time */
+static void slots_reverse_k(queue_head_t *q, unsigned int k)
+{
+    unsigned int groups = q->size / k;
+    if (!groups)
+        return;
+
+    slot_pos_t a = slot_first(q);
+    while (groups--) {
+        slot_pos_t b = a;
+        for (unsigned int i = 1; i < k; i++)
+            slot_next(q, &b);
+        slots_reverse(q, a, b, k);
+        a = b;
+        slot_next(q, &a);
+    }
+}
+
+static struct list_head *q_create(bool arena, int layout)
+{
+    queue_head_t *q = malloc(sizeof(queue_head_t));
+    if (!q)
+        return NULL;
+    INIT_LIST_HEAD(&q->head);
+    q->size = 0;
+    q->layout = layout;
+    q->arena = arena;
+    q->mixed = false;
+    q->slots_valid = layout != Q_LAYOUT_LIST;
+    q->links_valid = true;
+    INIT_LIST_HEAD(&q->chunks);
+    q->slots = NULL;
+    q->cap = q->first = 0;
+    INIT_LIST_HEAD(&q->blocks);
+    INIT_LIST_HEAD(&q->spare);
+    return &q->head;
+}
+
 /* Create an empty queue */
 struct list_head *q_new()
 {
-    struct list_head *head = malloc(sizeof(struct list_head));
-    if (!head)
-        return NULL;
-    INIT_LIST_HEAD(head);
-    return head;
+    return q_create(false, Q_LAYOUT_LIST);
+}
+
+/* Create an empty queue that allocates from an arena */
+struct list_head *q_new_arena()
+{
+    return q_create(true, Q_LAYOUT_LIST);
+}
+
+/* Create an empty queue that keeps its elements in a ring */
+struct list_head *q_new_ring()
+{
+    return q_create(false, Q_LAYOUT_RING);
+}
+
+/* Create an empty queue that keeps its elements in blocks */
+struct list_head *q_new_unrolled()
+{
+    return q_create(false, Q_LAYOUT_UNROLLED);
+}
+
+/* Look at the element at position i, counted from the tail if negative */
+element_t *q_peek(struct list_head *head, int i)
+{
+    if (!head)
+        return NULL;
+
+    queue_head_t *q = q_header(head);
+    if (i < 0)
+        i += q->size;
+    if (i < 0 || i >= q->size)
+        return NULL;
+
+    if (q->slots_valid)
+        return *slot_at(q, slot_find(q, i));
+
+    /* Walk from the closer end */
+    struct list_head *node = head;
+    if (i < q->size / 2) {
+        for (int j = 0; j <= i; j++)
+            node = node->next;
+    } else {
+        for (int j = q->size; j > i; j--)
+            node = node->prev;
+    }
+    return list_entry(node, element_t, list);
+}
+
+/* Free all storage used by queue */
+void q_free(struct list_head *head)
+{
+    if (!head)
+        return;
+
+    queue_head_t *q = q_header(head);
+    q_link(head);
+
+    /* Elements of a pure arena queue go away with its chunks */
+    if (!q->arena || q->mixed) {
+        element_t *entry, *safe;
+        list_for_each_entry_safe_prefetch(entry, safe, head, list, value)
+            q_release_element(entry);
+    }
+
+    arena_chunk_t *chunk, *next;
+    list_for_each_entry_safe(chunk, next, &q->chunks, list) {
+        if (chunk->map)
+            munmap(chunk->map, chunk->map_len);
+        free(chunk);
+    }
+
+    q_block_t *block, *tmp;
+    list_splice(&q->blocks, &q->spare);
+    list_for_each_entry_safe(block, tmp, &q->spare, list)
+        free(block);
+    free(q->slots);
+    free(q);
+
+    return;
+}
+
+/* Bytes an arena element holding a string of len bytes takes up */
+static inline size_t arena_element_size(size_t len)
+{
+    return len > Q_INLINE_LEN ? ARENA_ALIGN(sizeof(element_t) + len)
+                              : sizeof(element_t);
+}
+
+/* Store a copy of s in the arena element ele, right after it if too long */
+static inline void arena_element_fill(element_t *ele, const char *s, size_t len)
+{
+    ele->value = len > Q_INLINE_LEN ? (char *) (ele + 1) : ele->inline_value;
+    memcpy(ele->value, s, len);
+    ele->flags = Q_ELEM_ARENA;
+    element_cache(ele, len);
+}
+
+/* Carve an element and a copy of s out of the arena of q */
+static element_t *arena_element_new(queue_head_t *q, const char *s, size_t len)
+{
+    size_t need = arena_element_size(len);
+    arena_chunk_t *chunk = list_empty(&q->chunks)
+                               ? NULL
+                               : list_first_entry(&q->chunks, arena_chunk_t,
+                                                  list);
+
+    if (!chunk || chunk->cap - chunk->used < need) {
+        size_t cap = need > ARENA_CHUNK_SIZE ? need : ARENA_CHUNK_SIZE;
+        chunk = malloc(sizeof(arena_chunk_t) + cap);
+        if (!chunk)
+            return NULL;
+        chunk->used = 0;
+        chunk->cap = cap;
+        chunk->map = NULL;
+        list_add(&chunk->list, &q->chunks);
+    }
+
+    element_t *ele = (element_t *) (chunk->data + chunk->used);
+    chunk->used += need;
+    arena_element_fill(ele, s, len);
+    return ele;
+}
+
+/* Allocate a regular element holding a copy of s, which is len bytes long
+ * including the terminating null byte */
+static element_t *element_new(const char *s, size_t len)
+{
+    element_t *ele = malloc(sizeof(element_t));
+    if (!ele)
+        return NULL;
+
+    /* Short strings live inside the element and need no allocation */
+    if (len <= Q_INLINE_LEN) {
+        ele->value = ele->inline_value;
+    } else {
+        ele->value = malloc(len);
+        if (!ele->value) {
+            free(ele);
+            return NULL;
+        }
+    }
+    memcpy(ele->value, s, len);
+    ele->flags = 0;
+    element_cache(ele, len);
+    return ele;
+}
+
+/* Shared copy of a string, referenced by every interned element holding it */
+typedef struct intern_entry {
+    struct intern_entry *next;
+    uint64_t hash;
+    unsigned int refs;
+    char str[];
+} intern_entry_t;
+
+/* Intern table, chained hash buckets that come and go with its entries */
+static intern_entry_t **intern_table;
+static size_t intern_buckets, intern_count;
+static bool intern_mode;
+
+/* Number of buckets the intern table starts with */
+#define INTERN_MIN_BUCKETS 1024
+
+void q_set_intern(bool enable)
+{
+    intern_mode = enable;
+}
+
+/* FNV-1a hash of the len bytes of s */
+static inline uint64_t intern_hash(const char *s, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char) s[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+/* Double the buckets of the intern table, keeping it as is if that fails */
+static void intern_grow()
+{
+    size_t buckets = intern_buckets ? intern_buckets * 2 : INTERN_MIN_BUCKETS;
+    intern_entry_t **table = calloc(buckets, sizeof(intern_entry_t *));
+    if (!table)
+        return;
+
+    for (size_t i = 0; i < intern_buckets; i++) {
+        intern_entry_t *entry = intern_table[i], *next;
+        for (; entry; entry = next) {
+            next = entry->next;
+            intern_entry_t **bucket = &table[entry->hash & (buckets - 1)];
+            entry->next = *bucket;
+            *bucket = entry;
+        }
+    }
+    free(intern_table);
+    intern_table = table;
+    intern_buckets = buckets;
+}
+
+/* Return refs new references to the interned copy of s, which holds len
+ * bytes including the terminating null byte */
+static char *intern_get(const char *s, size_t len, unsigned int refs)
+{
+    if (intern_count >= intern_buckets)
+        intern_grow();
+    if (!intern_table)
+        return NULL;
+
+    uint64_t hash = intern_hash(s, len);
+    intern_entry_t **bucket = &intern_table[hash & (intern_buckets - 1)];
+    for (intern_entry_t *entry = *bucket; entry; entry = entry->next) {
+        if (entry->hash == hash && !memcmp(entry->str, s, len)) {
+            entry->refs += refs;
+            return entry->str;
+        }
+    }
+
+    intern_entry_t *entry = malloc(sizeof(intern_entry_t) + len);
+    if (!entry)
+        return NULL;
+    memcpy(entry->str, s, len);
+    entry->hash = hash;
+    entry->refs = refs;
+    entry->next = *bucket;
+    *bucket = entry;
+    intern_count++;
+    return entry->str;
+}
+
+/* Drop refs references to the interned string value */
+static void intern_put(char *value, unsigned int refs)
+{
+    intern_entry_t *entry =
+        (intern_entry_t *) (value - offsetof(intern_entry_t, str));
+    entry->refs -= refs;
+    if (entry->refs)
+        return;
+
+    intern_entry_t **link = &intern_table[entry->hash & (intern_buckets - 1)];
+    while (*link != entry)
+        link = &(*link)->next;
+    *link = entry->next;
+    free(entry);
+
+    /* Leave nothing allocated once no string is interned */
+    if (!--intern_count) {
+        free(intern_table);
+        intern_table = NULL;
+        intern_buckets = 0;
+    }
+}
+
+void q_intern_release(char *value)
+{
+    intern_put(value, 1);
+}
+
+/* Allocate an element pointing to the interned copy of s */
+static element_t *intern_element_new(const char *s, size_t len)
+{
+    element_t *ele = malloc(sizeof(element_t));
+    if (!ele)
+        return NULL;
+
+    ele->value = intern_get(s, len, 1);
+    if (!ele->value) {
+        free(ele);
+        return NULL;
+    }
+    ele->flags = Q_ELEM_INTERNED;
+    element_cache(ele, len);
+    return ele;
+}
+
+/* Allocate an element holding a copy of s */
+static element_t *q_element_new(queue_head_t *q, const char *s)
+{
+    size_t len = strlen(s) + 1;
+
+    if (q->arena)
+        return arena_element_new(q, s, len);
+    /* Short strings are stored inside the element anyway */
+    if (intern_mode && len > Q_INLINE_LEN)
+        return intern_element_new(s, len);
+    return element_new(s, len);
+}
+
+/* Allocate an element holding a copy of s and link it right after pos */
+static bool q_insert_after(struct list_head *head,
+                           struct list_head *pos,
+                           char *s)
+{
+    element_t *ele = q_element_new(q_header(head), s);
+    if (!ele)
+        return false;
+
+    list_add(&ele->list, pos);
+    q_header(head)->size++;
+
+    return true;
+}
+
+/* Allocate an element holding a copy of s and put it at either end of a ring
+ * or unrolled queue */
+static bool slots_insert(queue_head_t *q, char *s, bool at_head)
+{
+    if (!slots_reserve(q, 1, at_head))
+        return false;
+
+    element_t *ele = q_element_new(q, s);
+    if (!ele)
+        return false;
+
+    slots_push(q, ele, at_head);
+    return true;
+}
+
+/* Insert an element at head of queue */
+bool q_insert_head(struct list_head *head, char *s)
+{
+    if (!head)
+        return false;
+
+    if (slots_ready(q_header(head), true))
+        return slots_insert(q_header(head), s, true);
+
+    return q_insert_after(head, head, s);
+}
+
+/* Insert an element at tail of queue */
+bool q_insert_tail(struct list_head *head, char *s)
+{
+    if (!head)
+        return false;
+
+    if (slots_ready(q_header(head), true))
+        return slots_insert(q_header(head), s, false);
+
+    return q_insert_after(head, head->prev, s);
+}
+
+/* Carve n elements holding copies of sv[i % nstr] out of one chunk owned by
+ * the queue, and splice them at its head in reverse order or at its tail.
+ */
+static bool q_insert_n(struct list_head *head,
+                       char **sv,
+                       int nstr,
+                       int n,
+                       bool at_head)
+{
+    if (!head || !sv || nstr < 1 || n < 1)
+        return false;
+
+    queue_head_t *q = q_header(head);
+    bool slots = slots_ready(q, true);
+    if (slots && !slots_reserve(q, n, at_head))
+        return false;
+
+    /* The strings repeat every nstr elements, measure each of them once */
+    int cycle = nstr < n ? nstr : n, rest = n % nstr;
+    size_t *lens = malloc(cycle * sizeof(size_t));
+    if (!lens)
+        return false;
+    for (int i = 0; i < cycle; i++)
+        lens[i] = strlen(sv[i]) + 1;
+
+    /* In interning mode each long string is interned once, with a reference
+     * for every element that is going to hold it */
+    char **shared = NULL;
+    if (intern_mode && !q->arena) {
+        shared = calloc(cycle, sizeof(char *));
+        if (!shared) {
+            free(lens);
+            return false;
+        }
+        for (int i = 0; i < cycle; i++) {
+            if (lens[i] > Q_INLINE_LEN &&
+                !(shared[i] =
+                      intern_get(sv[i], lens[i], n / nstr + (i < rest))))
+                break;
+        }
+    }
+
+    size_t cycle_size = 0, rest_size = 0;
+    bool ok = true;
+    for (int i = 0; i < cycle; i++) {
+        size_t len = lens[i];
+        if (shared && len > Q_INLINE_LEN && !shared[i])
+            ok = false;
+        size_t need = shared ? sizeof(element_t) : arena_element_size(len);
+        cycle_size += need;
+        if (i < rest)
+            rest_size += need;
+    }
+    size_t total = (size_t) (n / nstr) * cycle_size + rest_size;
+
+    arena_chunk_t *chunk = ok ? malloc(sizeof(arena_chunk_t) + total) : NULL;
+    if (!chunk) {
+        for (int i = 0; shared && i < cycle; i++) {
+            if (shared[i])
+                intern_put(shared[i], n / nstr + (i < rest));
+        }
+        free(shared);
+        free(lens);
+        return false;
+    }
+    chunk->used = chunk->cap = total;
+    chunk->map = NULL;
+
+    /* Keep the chunk being carved by arena_element_new() in front */
+    list_add_tail(&chunk->list, &q->chunks);
+    if (!q->arena || shared)
+        q->mixed = true;
+
+    LIST_HEAD(batch);
+    char *mem = chunk->data;
+    for (int i = 0; i < n; i++) {
+        const char *str = sv[i % nstr];
+        size_t len = lens[i % nstr];
+        element_t *ele = (element_t *) mem;
+
+        if (shared && shared[i % nstr]) {
+            ele->value = shared[i % nstr];
+            ele->flags = Q_ELEM_ARENA | Q_ELEM_INTERNED;
+            element_cache(ele, len);
+            mem += sizeof(element_t);
+        } else {
+            arena_element_fill(ele, str, len);
+            mem += shared ? sizeof(element_t) : arena_element_size(len);
+        }
+        if (slots)
+            slots_push(q, ele, at_head);
+        else if (at_head)
+            list_add(&ele->list, &batch);
+        else
+            list_add_tail(&ele->list, &batch);
+    }
+
+    free(shared);
+    free(lens);
+    if (slots)
+        return true;
+
+    if (at_head)
+        list_splice(&batch, head);
+    else
+        list_splice_tail(&batch, head);
+    q->size += n;
+
+    return true;
+}
+
+/* Insert n elements at head of queue, as many q_insert_head() calls would */
+bool q_insert_head_n(struct list_head *head, char **sv, int nstr, int n)
+{
+    return q_insert_n(head, sv, nstr, n, true);
+}
+
+/* Insert n elements at tail of queue, as many q_insert_tail() calls would */
+bool q_insert_tail_n(struct list_head *head, char **sv, int nstr, int n)
+{
+    return q_insert_n(head, sv, nstr, n, false);
+}
+
+/* Unlink the element at node */
+static element_t *q_detach_node(struct list_head *head, struct list_head *node)
+{
+    element_t *ele = list_entry(node, element_t, list);
+
+    list_del_init(&ele->list);
+    q_header(head)->size--;
+
+    return ele;
+}
+
+/* Remove an element from either end of queue, leaving its string alone */
+static element_t *q_detach(struct list_head *head, bool at_head)
+{
+    if (!head)
+        return NULL;
+
+    queue_head_t *q = q_header(head);
+    if (slots_ready(q, true))
+        return q->size ? slots_pop(q, at_head) : NULL;
+
+    if (list_empty(head))
+        return NULL;
+
+    return q_detach_node(head, at_head ? head->next : head->prev);
+}
+
+/* Remove an element from head of queue without copying its string */
+element_t *q_detach_head(struct list_head *head)
+{
+    return q_detach(head, true);
+}
+
+/* Remove an element from tail of queue without copying its string */
+element_t *q_detach_tail(struct list_head *head)
+{
+    return q_detach(head, false);
+}
+
+/* Remove an element from head of queue */
+element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
+{
+    element_t *ele = q_detach(head, true);
+    if (ele)
+        element_copy(ele, sp, bufsize);
+    return ele;
+}
+
+/* Remove an element from tail of queue */
+element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize)
+{
+    element_t *ele = q_detach(head, false);
+    if (ele)
+        element_copy(ele, sp, bufsize);
+    return ele;
+}
+
+/* Release a detached element, handing its string over to the caller */
+char *q_take_value(element_t *e)
+{
+    if (!e)
+        return NULL;
+
+    /* Only a separately allocated string can change hands as it is */
+    char *value = e->value;
+    if ((e->flags & (Q_ELEM_ARENA | Q_ELEM_INTERNED)) ||
+        value == e->inline_value) {
+        value = malloc(e->len + 1);
+        if (!value)
+            return NULL;
+        memcpy(value, e->value, e->len + 1);
+    } else {
+        e->value = e->inline_value;
+    }
+    q_release_element(e);
+    return value;
+}
+
+/* Move the nodes of head up to and including last to the tail of list */
+static void q_cut_head(struct list_head *head,
+                       struct list_head *last,
+                       int count,
+                       struct list_head *list)
+{
+    LIST_HEAD(cut);
+
+    list_cut_position(&cut, head, last);
+    list_splice_tail(&cut, list);
+    q_header(head)->size -= count;
+}
+
+/* Remove up to n elements from head of queue into list */
+int q_remove_head_n(struct list_head *head, struct list_head *list, int n)
+{
+    if (!head || !list || n < 1)
+        return 0;
+
+    int size = q_size(head);
+    if (n > size)
+        n = size;
+
+    queue_head_t *q = q_header(head);
+    if (slots_ready(q, true)) {
+        for (int i = 0; i < n; i++)
+            list_add_tail(&slots_pop(q, true)->list, list);
+        return n;
+    }
+
+    if (list_empty(head))
+        return 0;
+
+    /* Walk to the n-th node from the closer end of the queue */
+    struct list_head *last = head;
+    if (n <= size / 2) {
+        for (int i = 0; i < n; i++)
+            last = last->next;
+    } else {
+        for (int i = size; i >= n; i--)
+            last = last->prev;
+    }
+
+    q_cut_head(head, last, n, list);
+    return n;
+}
+
+/* Remove up to n elements from head of queue into list, packing their strings
+ * into buf */
+int q_remove_head_copy_n(struct list_head *head,
+                         struct list_head *list,
+                         int n,
+                         char *buf,
+                         size_t bufsize,
+                         size_t *offsets)
+{
+    if (!head || !list || !buf || !offsets || n < 1)
+        return 0;
+
+    queue_head_t *q = q_header(head);
+    size_t used = 0;
+    int count = 0;
+
+    if (slots_ready(q, true)) {
+        for (; count < n && q->size; count++) {
+            size_t offset = used;
+            if (!element_pack(*slot_at(q, slot_first(q)), buf, bufsize,
+                              &used))
+                break;
+            offsets[count] = offset;
+            list_add_tail(&slots_pop(q, true)->list, list);
+        }
+        return count;
+    }
+
+    if (list_empty(head))
+        return 0;
+
+    struct list_head *node = head->next, *last = head;
+
+    for (; count < n && node != head; last = node, node = node->next) {
+        size_t offset = used;
+        if (!element_pack(list_entry(node, element_t, list), buf, bufsize,
+                          &used))
+            break;
+        offsets[count++] = offset;
+    }
+
+    if (count)
+        q_cut_head(head, last, count, list);
+    return count;
+}
+
+/* Return number of elements in queue */
+int q_size(struct list_head *head)
+{
+    if (!head)
+        return 0;
+
+    return q_header(head)->size;
+}
+
+/* Account for nodes spliced into or out of the queue by the caller */
+void q_size_adjust(struct list_head *head, int delta)
+{
+    if (!head)
+        return;
+
+    q_header(head)->size += delta;
+    q_header(head)->slots_valid = false;
+}
+
+/* Recompute the cached element count by walking the queue */
+int q_size_sync(struct list_head *head)
+{
+    if (!head)
+        return 0;
+
+    slots_leave(head);
+    int len = 0;
+    struct list_head *li;
+
+    list_for_each_prefetch(li, head)
+        len++;
+    q_header(head)->size = len;
+    return len;
+}
+
+/* Take the i-th element out of the blocks of an unrolled queue, closing the
+ * gap from whichever side of its block is shorter */
+static element_t *blocks_take(queue_head_t *q, unsigned int i)
+{
+    slot_pos_t pos = slot_find(q, i);
+    q_block_t *block = pos.block;
+    element_t *ele = block->ele[pos.i];
+
+    if (pos.i - block->lo < block->hi - 1 - pos.i) {
+        memmove(&block->ele[block->lo + 1], &block->ele[block->lo],
+                (pos.i - block->lo) * sizeof(element_t *));
+        block->lo++;
+    } else {
+        memmove(&block->ele[pos.i], &block->ele[pos.i + 1],
+                (block->hi - 1 - pos.i) * sizeof(element_t *));
+        block->hi--;
+    }
+    if (block->lo == block->hi)
+        list_move(&block->list, &q->spare);
+    q->size--;
+    q->links_valid = false;
+    INIT_LIST_HEAD(&ele->list);
+    return ele;
+}
+
+/* Delete the middle node in queue */
+bool q_delete_mid(struct list_head *head)
+{
+    if (!head)
+        return false;
+
+    queue_head_t *q = q_header(head);
+    if (q->layout == Q_LAYOUT_UNROLLED && q->size && slots_ready(q, true)) {
+        q_release_element(blocks_take(q, (q->size - 1) / 2));
+        return true;
+    }
+
+    slots_leave(head);
+    if (list_empty(head))
+        return false;
+
+    struct list_head *L = head->next, *R = head->prev;
+    while (L != R && L->next != R) {
+        L = L->next;
+        R = R->prev;
+    }
+    element_t *mid = list_entry(L, element_t, list);
+
+    list_del_init(&mid->list);
+    q_release_element(mid);
+    q_header(head)->size--;
+
+    return true;
+}
+
+/* Delete all nodes that have duplicate string */
+bool q_delete_dup(struct list_head *head)
+{
+    slots_leave(head);
+    if (!head || list_empty(head))
+        return false;
+
+    element_t *L, *R;
+    bool has_dup = false;
+
+    list_for_each_entry_safe_prefetch(L, R, head, list, value) {
+        if (&R->list != head && element_eq(L, R)) {
+            has_dup = true;
+            list_del_init(&L->list);
+            q_release_element(L);
+            q_header(head)->size--;
+        } else if (has_dup) {
+            has_dup = false;
+            list_del_init(&L->list);
+            q_release_element(L);
+            q_header(head)->size--;
+        }
+    }
+
+    return true;
+}
+
+/* Swap every two adjacent nodes */
+void q_swap(struct list_head *head)
+{
+    if (!head)
+        return;
+
+    queue_head_t *q = q_header(head);
+    if (slots_ready(q, false)) {
+        slots_reverse_k(q, 2);
+        return;
+    }
+
+    for (struct list_head *node = head->next;
+         node != head && node->next != head; node = node->next)
+        list_move(node, node->next);
+}
+
+/* Reverse the nodes of a plain list, which need not be the head of a queue */
+static void reverse_nodes(struct list_head *head)
+{
+    if (list_empty(head))
+        return;
+
+    struct list_head *L, *R;
+
+    list_for_each_safe_prefetch(L, R, head) {
+        L->next = L->prev;
+        L->prev = R;
+    }
+
+    head->next = head->prev;
+    head->prev = R;
+}
+
+/* Reverse elements in queue */
+void q_reverse(struct list_head *head)
+{
+    if (!head)
+        return;
+
+    queue_head_t *q = q_header(head);
+    if (slots_ready(q, false)) {
+        if (q->size > 1)
+            slots_reverse(q, slot_first(q), slot_last(q), q->size);
+        return;
+    }
+
+    reverse_nodes(head);
+}
+
+/* Reverse the nodes of the list k at a time */
+void q_reverseK(struct list_head *head, int k)
+{
+    if (!head || k <= 1)
+        return;
+
+    queue_head_t *q = q_header(head);
+    if (slots_ready(q, false)) {
+        slots_reverse_k(q, k);
+        return;
+    }
+
+    if (list_empty(head) || list_is_singular(head))
+        return;
+
+    if (k == 2) {
+        q_swap(head);
+        return;
+    }
+
+    /* The element count is cached, so the number of groups is known upfront
+     * and each group is reversed in the same pass that walks it.
+     */
+    struct list_head *before = head, *node = head->next;
+
+    for (int group = q_size(head) / k; group > 0; group--) {
+        struct list_head *first = node, *last = NULL;
+
+        for (int i = 0; i < k; i++) {
+            struct list_head *next = node->next;
+            node->next = node->prev;
+            node->prev = next;
+            last = node;
+            node = next;
+        }
+
+        before->next = last;
+        last->prev = before;
+        first->next = node;
+        node->prev = first;
+        before = first;
+    }
+}
+
+/* Ascending order of elements for list_sort() */
+static inline int q_cmp_ascend(void *priv,
+                               const struct list_head *a,
+                               const struct list_head *b)
+{
+    return element_cmp(list_entry(a, element_t, list),
+                       list_entry(b, element_t, list));
+}
+
+/* Descending order of elements for list_sort() */
+static inline int q_cmp_descend(void *priv,
+                                const struct list_head *a,
+                                const struct list_head *b)
+{
+    return element_cmp(list_entry(b, element_t, list),
+                       list_entry(a, element_t, list));
+}
+
+/* Merge two sorted chains of elements with list_merge(), which is inlined
+ * once per direction with its comparator */
+static struct list_head *q_merge_chains(struct list_head *a,
+                                        struct list_head *b,
+                                        bool descend)
+{
+    if (descend)
+        return list_merge(NULL, q_cmp_descend, a, b);
+    return list_merge(NULL, q_cmp_ascend, a, b);
+}
+
+/* Link the NULL-terminated chain of nodes into the empty list head */
+static void relink_chain(struct list_head *head, struct list_head *node)
+{
+    struct list_head *prev = head;
+
+    for (; node; prev = node, node = node->next) {
+        prev->next = node;
+        node->prev = prev;
+    }
+    prev->next = head;
+    head->prev = prev;
+}
+
+/* Entry of the arrays sorted by the prefix and radix sorts */
+typedef struct {
+    uint64_t key; /* first 8 bytes of the string, big-endian, zero padded */
+    struct list_head *node;
+} sort_slot_t;
+
+/* Runs shorter than this are sorted by insertion before merging */
+#define PREFIX_SORT_RUN 16
+
+/* Buckets smaller than this are left to the prefix sort by the radix sort */
+#define RADIX_SORT_CUTOFF 64
+
+/* Queue sizes from which Q_SORT_AUTO prefers the array-based engines */
+#define AUTO_PREFIX_MIN 16
+#define AUTO_RADIX_MIN 1024
+
+/* A leading run of at least 1 / PRESORTED_RUN_SHARE of the slots is kept, and
+ * only the slots after it are sorted and merged with it */
+#define PRESORTED_RUN_SHARE 4
+
+/* Queue size from which Q_SORT_AUTO sorts in parallel if threads are allowed */
+#define AUTO_PARALLEL_MIN (128 * 1024)
+
+/* Working memory handed over by the caller, see q_sort_set_scratch() */
+static sort_slot_t *sort_scratch;
+static size_t sort_scratch_size;
+
+static int sort_engine = Q_SORT_AUTO;
+static int sort_threads = 1;
+
+static inline const char *slot_str(const sort_slot_t *slot)
+{
+    return list_entry(slot->node, element_t, list)->value;
+}
+
+static inline int slot_cmp(const sort_slot_t *a, const sort_slot_t *b)
+{
+    if (a->key != b->key)
+        return a->key < b->key ? -1 : 1;
+    /* Both strings ended within the prefix */
+    if (!(a->key & 0xff))
+        return 0;
+    return strcmp(slot_str(a) + 8, slot_str(b) + 8);
+}
+
+/* Whether b has to be placed before a */
+static __LIST_ALWAYS_INLINE bool slot_before(const sort_slot_t *b,
+                                             const sort_slot_t *a,
+                                             bool descend)
+{
+    int c = slot_cmp(b, a);
+    return descend ? c > 0 : c < 0;
+}
+
+/* Stable merge of the sorted runs src[lo, mid) and src[mid, hi) into dst */
+static __LIST_ALWAYS_INLINE void slot_merge(sort_slot_t *dst,
+                                            const sort_slot_t *src,
+                                            size_t lo,
+                                            size_t mid,
+                                            size_t hi,
+                                            bool descend)
+{
+    size_t i = lo, j = mid, k = lo;
+
+    while (i < mid && j < hi) {
+        if (slot_before(&src[j], &src[i], descend))
+            dst[k++] = src[j++];
+        else
+            dst[k++] = src[i++];
+    }
+    while (i < mid)
+        dst[k++] = src[i++];
+    while (j < hi)
+        dst[k++] = src[j++];
+}
+
+/* Stable sort of a[0, n) using b[0, n) as auxiliary space, in the direction
+ * given as a constant by slot_sort() */
+static __LIST_ALWAYS_INLINE void slot_sort_dir(sort_slot_t *a,
+                                               sort_slot_t *b,
+                                               size_t n,
+                                               bool descend)
+{
+    sort_slot_t *src = a, *dst = b;
+
+    /* Insertion sort on short runs keeps the early passes in cache */
+    for (size_t lo = 0; lo < n; lo += PREFIX_SORT_RUN) {
+        size_t hi = lo + PREFIX_SORT_RUN < n ? lo + PREFIX_SORT_RUN : n;
+        for (size_t i = lo + 1; i < hi; i++) {
+            sort_slot_t tmp = a[i];
+            size_t j = i;
+            for (; j > lo && slot_before(&tmp, &a[j - 1], descend); j--)
+                a[j] = a[j - 1];
+            a[j] = tmp;
+        }
+    }
+
+    for (size_t width = PREFIX_SORT_RUN; width < n; width *= 2) {
+        for (size_t lo = 0; lo < n; lo += 2 * width) {
+            size_t mid = lo + width < n ? lo + width : n;
+            size_t hi = lo + 2 * width < n ? lo + 2 * width : n;
+            slot_merge(dst, src, lo, mid, hi, descend);
+        }
+        sort_slot_t *tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+
+    if (src != a)
+        memcpy(a, src, n * sizeof(sort_slot_t));
+}
+
+static void slot_sort(sort_slot_t *a, sort_slot_t *b, size_t n, bool descend)
+{
+    if (descend)
+        slot_sort_dir(a, b, n, true);
+    else
+        slot_sort_dir(a, b, n, false);
+}
+
+/* Merge the sorted runs src[0, mid) and src[mid, n) into dst */
+static void slot_merge_runs(sort_slot_t *dst,
+                            const sort_slot_t *src,
+                            size_t mid,
+                            size_t n,
+                            bool descend)
+{
+    if (descend)
+        slot_merge(dst, src, 0, mid, n, true);
+    else
+        slot_merge(dst, src, 0, mid, n, false);
+}
+
+/* Stable MSD radix sort of a[0, n) whose strings share their first depth
+ * bytes, using b[0, n) as auxiliary space. Once the 8-byte key is exhausted,
+ * the remaining ties are handed to the comparison sort.
+ */
+static void slot_radix(sort_slot_t *a,
+                       sort_slot_t *b,
+                       size_t n,
+                       int depth,
+                       bool descend)
+{
+    if (n < RADIX_SORT_CUTOFF || depth == 8) {
+        slot_sort(a, b, n, descend);
+        return;
+    }
+
+    size_t count[256] = {0}, start[256];
+    int shift = 56 - 8 * depth;
+
+    for (size_t i = 0; i < n; i++)
+        count[(a[i].key >> shift) & 0xff]++;
+
+    /* Strings ending here come first, or last when descending */
+    size_t pos = 0;
+    for (int i = 0; i < 256; i++) {
+        int c = descend ? 255 - i : i;
+        start[c] = pos;
+        pos += count[c];
+    }
+
+    /* All strings share this byte as well */
+    int first = (a[0].key >> shift) & 0xff;
+    if (count[first] != n) {
+        for (size_t i = 0; i < n; i++)
+            b[start[(a[i].key >> shift) & 0xff]++] = a[i];
+        memcpy(a, b, n * sizeof(sort_slot_t));
+    } else {
+        start[first] = n;
+    }
+
+    /* Bucket 0 holds strings that ended, which are all equal */
+    for (int c = 1; c < 256; c++) {
+        size_t len = count[c], lo = start[c] - len;
+        if (len > 1)
+            slot_radix(a + lo, b + lo, len, depth + 1, descend);
+    }
+}
+
+/* Gather the key prefix and node of every element into a */
+static void slot_gather(struct list_head *head, sort_slot_t *a)
+{
+    element_t *ele;
+    size_t i = 0;
+
+    list_for_each_entry_prefetch(ele, head, list, value) {
+        a[i].key = str_key(ele->value);
+        a[i++].node = &ele->list;
+    }
+}
+
+/* Return the length of the natural run at the start of a, and whether it is
+ * in strictly reverse order. Random input is told apart after a few slots.
+ */
+static size_t slot_leading_run(const sort_slot_t *a,
+                               size_t n,
+                               bool descend,
+                               bool *reversed)
+{
+    size_t i = 1;
+
+    *reversed = false;
+    if (n < 2)
+        return n;
+
+    int cmp = slot_cmp(&a[0], &a[1]);
+    if (descend ? cmp < 0 : cmp > 0) {
+        *reversed = true;
+        for (i = 2; i < n; i++) {
+            cmp = slot_cmp(&a[i - 1], &a[i]);
+            if (descend ? cmp >= 0 : cmp <= 0)
+                break;
+        }
+        return i;
+    }
+
+    for (i = 2; i < n; i++) {
+        cmp = slot_cmp(&a[i - 1], &a[i]);
+        if (descend ? cmp < 0 : cmp > 0)
+            break;
+    }
+    return i;
+}
+
+/* Sort a[0, n) with the prefix or radix engine, using b[0, n) as auxiliary
+ * space. A long enough leading run is kept, so that a sorted queue with a few
+ * appended elements only costs sorting those and one merge.
+ *
+ * Return 1 if a is already sorted, -1 if it is sorted in strictly reverse
+ * order, leaving it untouched in both cases, and 0 once a holds the sorted
+ * order.
+ */
+static int slot_sort_runs(sort_slot_t *a,
+                          sort_slot_t *b,
+                          size_t n,
+                          int engine,
+                          bool descend)
+{
+    bool reversed;
+    size_t run = slot_leading_run(a, n, descend, &reversed);
+
+    if (run == n)
+        return reversed ? -1 : 1;
+
+    if (run < n / PRESORTED_RUN_SHARE) {
+        run = 0;
+    } else if (reversed) {
+        /* Strictly reverse, so reversing it keeps the sort stable */
+        for (size_t i = 0, j = run - 1; i < j; i++, j--) {
+            sort_slot_t tmp = a[i];
+            a[i] = a[j];
+            a[j] = tmp;
+        }
+    }
+
+    if (engine == Q_SORT_RADIX)
+        slot_radix(a + run, b + run, n - run, 0, descend);
+    else
+        slot_sort(a + run, b + run, n - run, descend);
+
+    if (run) {
+        slot_merge_runs(b, a, run, n, descend);
+        memcpy(a, b, n * sizeof(sort_slot_t));
+    }
+    return 0;
+}
+
+/* Relink the list in the order of a */
+static void slot_relink(struct list_head *head, const sort_slot_t *a, size_t n)
+{
+    struct list_head *prev = head;
+    for (size_t i = 0; i < n; i++) {
+        prev->next = a[i].node;
+        a[i].node->prev = prev;
+        prev = a[i].node;
+    }
+    prev->next = head;
+    head->prev = prev;
 }
 
-/* Free all storage used by queue */
-void q_free(struct list_head *head)
+/* Bytes of working memory the array-based sorts need for n elements */
+size_t q_sort_scratch_size(int n)
 {
-    if (!head)
-        return;
+    return n > 0 ? 2 * (size_t) n * sizeof(sort_slot_t) : 0;
+}
 
-    element_t *entry, *safe;
-    list_for_each_entry_safe(entry, safe, head, list) {
-        free(entry->value);
-        free(entry);
-    }
-    free(head);
+/* Provide working memory for q_sort() */
+void q_sort_set_scratch(void *buf, size_t size)
+{
+    sort_scratch = buf;
+    sort_scratch_size = buf ? size : 0;
+}
 
-    return;
+/* Select the algorithm used by q_sort() */
+bool q_sort_set_engine(int engine)
+{
+    if (engine < Q_SORT_AUTO || engine > Q_SORT_PARALLEL)
+        return false;
+    sort_engine = engine;
+    return true;
 }
 
-/* Insert an element at head of queue */
-bool q_insert_head(struct list_head *head, char *s)
+/* Set the number of threads the parallel sort may use */
+bool q_sort_set_threads(int threads)
 {
-    if (!head)
+    if (threads < 1 || threads > Q_SORT_MAX_THREADS)
         return false;
+    sort_threads = threads;
+    return true;
+}
 
-    element_t *ele = malloc(sizeof(element_t));
-    if (!ele)
+/* Merge sort on the list itself, needs no working memory */
+static void q_sort_list(struct list_head *head, bool descend)
+{
+    /* One instance of list_sort() per direction, with the comparator inlined */
+    if (descend)
+        list_sort(NULL, head, q_cmp_descend);
+    else
+        list_sort(NULL, head, q_cmp_ascend);
+}
+
+/* Resolve Q_SORT_AUTO to a single-threaded engine, and fall back to the list
+ * sort when the requested engine has no working memory to run with.
+ */
+static int sort_pick_engine(int engine, size_t n, bool has_scratch)
+{
+    if (!has_scratch)
+        return Q_SORT_LIST;
+    if (engine == Q_SORT_AUTO || engine == Q_SORT_PARALLEL)
+        return n < AUTO_PREFIX_MIN  ? Q_SORT_LIST
+               : n < AUTO_RADIX_MIN ? Q_SORT_PREFIX
+                                    : Q_SORT_RADIX;
+    return engine;
+}
+
+/* Sort the n nodes of head on the calling thread. a and b point to n slots
+ * each, or are NULL when no working memory is available.
+ */
+static void sort_nodes(struct list_head *head,
+                       size_t n,
+                       bool descend,
+                       int engine,
+                       sort_slot_t *a,
+                       sort_slot_t *b)
+{
+    engine = sort_pick_engine(engine, n, a);
+
+    if (engine == Q_SORT_LIST) {
+        q_sort_list(head, descend);
+        return;
+    }
+
+    slot_gather(head, a);
+    int order = slot_sort_runs(a, b, n, engine, descend);
+    /* head may be a segment of the parallel sort rather than a queue */
+    if (order < 0)
+        reverse_nodes(head);
+    else if (!order)
+        slot_relink(head, a, n);
+}
+
+/* Sort a ring or unrolled queue on its slots, unless the list sort is selected
+ * or there is no working memory for the array-based engines */
+static bool slots_sort(queue_head_t *q, bool descend)
+{
+    size_t n = q->size;
+    if (n < 2)
+        return true;
+    if (q_sort_scratch_size(n) > sort_scratch_size)
         return false;
 
-    ele->value = strdup(s);
-    if (!ele->value) {
-        free(ele);
+    int engine = sort_pick_engine(sort_engine, n, true);
+    if (engine == Q_SORT_LIST)
         return false;
+
+    sort_slot_t *a = sort_scratch, *b = sort_scratch + n;
+    slot_pos_t pos = slot_first(q);
+    for (size_t i = 0; i < n; i++, slot_next(q, &pos)) {
+        element_t *ele = *slot_at(q, pos);
+        a[i].key = str_key(ele->value);
+        a[i].node = &ele->list;
     }
 
-    list_add(&ele->list, head);
+    int order = slot_sort_runs(a, b, n, engine, descend);
+    if (order) {
+        if (order < 0)
+            slots_reverse(q, slot_first(q), slot_last(q), n);
+        return true;
+    }
 
+    pos = slot_first(q);
+    for (size_t i = 0; i < n; i++, slot_next(q, &pos))
+        *slot_at(q, pos) = list_entry(a[i].node, element_t, list);
+    q->links_valid = false;
     return true;
 }
 
-/* Insert an element at tail of queue */
-bool q_insert_tail(struct list_head *head, char *s)
+/* Segment of a queue sorted, then merged, by one worker thread */
+typedef struct {
+    struct list_head head; /* segment while being sorted */
+    struct list_head *run; /* NULL-terminated sorted chain while merging */
+    struct list_head *later; /* chain to merge into run */
+    size_t n;
+    sort_slot_t *a, *b;
+    bool descend;
+} sort_task_t;
+
+static void *sort_segment_worker(void *arg)
 {
-    if (!head)
-        return false;
+    sort_task_t *task = arg;
 
-    return q_insert_head(head->prev, s);
+    sort_nodes(&task->head, task->n, task->descend, Q_SORT_AUTO, task->a,
+               task->b);
+    task->head.prev->next = NULL;
+    task->run = task->head.next;
+    return NULL;
 }
 
-/* Remove an element from head of queue */
-element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
+static void *sort_merge_worker(void *arg)
 {
-    if (!head || list_empty(head))
-        return NULL;
+    sort_task_t *task = arg;
 
-    element_t *ele = list_entry(head->next, element_t, list);
+    /* Ties are taken from run, which is the earlier segment */
+    task->run = q_merge_chains(task->run, task->later, task->descend);
+    return NULL;
+}
 
-    if (sp) {
-        size_t n = strlen(ele->value);
-        if (bufsize - 1 < n)
-            n = bufsize - 1;
-        strncpy(sp, ele->value, n);
-        sp[n] = '\0';
-    }
+/* Run worker on tasks[0, n) with one thread each. SIGALRM is blocked by the
+ * caller, and so in the workers, which inherit its signal mask.
+ */
+static void sort_run_workers(void *(*worker)(void *),
+                             sort_task_t *tasks,
+                             size_t stride,
+                             int n)
+{
+    pthread_t tid[Q_SORT_MAX_THREADS];
+    int spawned = 0;
 
-    list_del_init(&ele->list);
+    for (int i = 1; i < n; i++) {
+        if (pthread_create(&tid[i], NULL, worker, &tasks[i * stride]))
+            break;
+        spawned = i;
+    }
 
-    return ele;
+    /* The calling thread takes the first task, and any that failed to spawn */
+    worker(&tasks[0]);
+    for (int i = spawned + 1; i < n; i++)
+        worker(&tasks[i * stride]);
+    for (int i = 1; i <= spawned; i++)
+        pthread_join(tid[i], NULL);
 }
-/* Remove an element from tail of queue */
-element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize)
+
+/* Split the queue into sort_threads segments, sort them concurrently, then
+ * merge the sorted segments pairwise in a tree, one thread per pair.
+ *
+ * SIGALRM stays blocked until every worker has been joined: the time limit
+ * jumps out of the calling thread, which must not leave workers running on
+ * its stack and on the list. An expired limit is handled once the sort is
+ * complete.
+ */
+static void q_sort_parallel(struct list_head *head, size_t n, bool descend)
 {
-    if (!head)
-        return NULL;
+    sort_task_t tasks[Q_SORT_MAX_THREADS];
+    sigset_t block, old;
+    int nr = sort_threads;
+    if ((size_t) nr > n)
+        nr = n;
+
+    sigemptyset(&block);
+    sigaddset(&block, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+
+    sort_slot_t *a = NULL, *b = NULL;
+    if (q_sort_scratch_size(n) <= sort_scratch_size) {
+        a = sort_scratch;
+        b = sort_scratch + n;
+    }
+
+    size_t lo = 0;
+    for (int i = 0; i < nr; i++) {
+        sort_task_t *task = &tasks[i];
+        size_t len = (n - lo) / (nr - i);
+        struct list_head *cut = head;
+
+        for (size_t j = 0; j < len; j++)
+            cut = cut->next;
+        list_cut_position(&task->head, head, cut);
+        task->n = len;
+        task->a = a ? a + lo : NULL;
+        task->b = b ? b + lo : NULL;
+        task->descend = descend;
+        lo += len;
+    }
+
+    sort_run_workers(sort_segment_worker, tasks, 1, nr);
 
-    return q_remove_head(head->prev->prev, sp, bufsize);
+    for (int stride = 1; stride < nr; stride *= 2) {
+        int pairs = 0;
+        for (int i = 0; i + stride < nr; i += 2 * stride) {
+            tasks[i].later = tasks[i + stride].run;
+            pairs++;
+        }
+        sort_run_workers(sort_merge_worker, tasks, 2 * stride, pairs);
+    }
+
+    relink_chain(head, tasks[0].run);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
 }
 
-/* Return number of elements in queue */
-int q_size(struct list_head *head)
+/* Sort elements of queue in ascending/descending order */
+void q_sort(struct list_head *head, bool descend)
 {
     if (!head)
-        return 0;
+        return;
 
-    int len = 0;
-    struct list_head *li;
+    queue_head_t *q = q_header(head);
+    if (slots_ready(q, false) && slots_sort(q, descend))
+        return;
 
-    list_for_each(li, head)
-        len++;
-    return len;
+    slots_leave(head);
+    if (list_empty(head) || list_is_singular(head))
+        return;
+
+    size_t n = q_size(head);
+    bool parallel = sort_engine == Q_SORT_PARALLEL ||
+                    (sort_engine == Q_SORT_AUTO && n >= AUTO_PARALLEL_MIN);
+    if (parallel && sort_threads > 1) {
+        q_sort_parallel(head, n, descend);
+        return;
+    }
+
+    bool has_scratch = q_sort_scratch_size(n) <= sort_scratch_size;
+    sort_nodes(head, n, descend, sort_engine,
+               has_scratch ? sort_scratch : NULL,
+               has_scratch ? sort_scratch + n : NULL);
 }
 
-/* Delete the middle node in queue */
-bool q_delete_mid(struct list_head *head)
+/* Whether q_ascend() and q_descend() free the removed nodes after their pass */
+static bool batch_free;
+
+/* Choose how q_ascend() and q_descend() free the nodes they remove */
+void q_set_batch_free(bool enable)
+{
+    batch_free = enable;
+}
+
+/* Release the elements of a NULL-terminated chain of nodes */
+static void q_release_chain(struct list_head *node)
+{
+    while (node) {
+        struct list_head *next = node->next;
+        q_release_element(list_entry(node, element_t, list));
+        node = next;
+    }
+}
+
+/* Walk from the tail and remove every node placed after a kept node to its
+ * right, i.e. greater than the minimum or less than the maximum seen so far.
+ */
+static int q_monotonic(struct list_head *head, bool descend)
 {
+    slots_leave(head);
     if (!head || list_empty(head))
-        return false;
+        return 0;
 
-    struct list_head *L = head->next, *R = head->prev;
-    while (L != R && L->next != R) {
-        L = L->next;
-        R = R->prev;
+    struct list_head *kept = head->prev, *node = kept->prev, *removed = NULL;
+    const element_t *bound = list_entry(kept, element_t, list);
+    int count = 1;
+
+    while (node != head) {
+        struct list_head *prev = node->prev;
+        element_t *ele = list_entry(node, element_t, list);
+        int cmp = element_cmp(ele, bound);
+
+        list_prefetch(prev->prev);
+        if (descend ? cmp < 0 : cmp > 0) {
+            prev->next = kept;
+            kept->prev = prev;
+            if (batch_free) {
+                node->next = removed;
+                removed = node;
+            } else {
+                q_release_element(ele);
+            }
+        } else {
+            kept = node;
+            bound = ele;
+            count++;
+        }
+        node = prev;
     }
-    element_t *mid = list_entry(L, element_t, list);
 
-    list_del_init(&mid->list);
-    free(mid->value);
-    free(mid);
+    q_release_chain(removed);
+    q_header(head)->size = count;
+    return count;
+}
 
-    return true;
+/* Remove every node which has a node with a strictly less value anywhere to
+ * the right side of it */
+int q_ascend(struct list_head *head)
+{
+    return q_monotonic(head, false);
 }
 
-/* Delete all nodes that have duplicate string */
-bool q_delete_dup(struct list_head *head)
+/* Remove every node which has a node with a strictly greater value anywhere to
+ * the right side of it */
+int q_descend(struct list_head *head)
 {
-    if (!head || list_empty(head))
-        return false;
+    return q_monotonic(head, true);
+}
 
-    element_t *L, *R;
-    bool has_dup = false;
+/* Number of non-empty queues up to which q_merge() uses a heap */
+#define MERGE_HEAP_MAX 64
 
-    list_for_each_entry_safe(L, R, head, list) {
-        if (&R->list != head && !strcmp(L->value, R->value)) {
-            has_dup = true;
-            list_del_init(&L->list);
-            free(L->value);
-            free(L);
-        } else if (has_dup) {
-            has_dup = false;
-            list_del_init(&L->list);
-            free(L->value);
-            free(L);
-        }
-    }
+/* Queue taking part in the k-way merge */
+typedef struct {
+    struct list_head *node; /* first element not merged yet */
+    struct list_head *end;  /* head of the queue, reached when exhausted */
+    int order;              /* position of the queue in the chain */
+} merge_src_t;
 
-    return true;
+/* Whether the next element of a has to be emitted before the one of b */
+static __LIST_ALWAYS_INLINE bool merge_before(const merge_src_t *a,
+                                              const merge_src_t *b,
+                                              bool descend)
+{
+    int cmp = element_cmp(list_entry(a->node, element_t, list),
+                          list_entry(b->node, element_t, list));
+    if (cmp)
+        return descend ? cmp > 0 : cmp < 0;
+    /* Equal strings keep the order of their queues in the chain */
+    return a->order < b->order;
 }
 
-/* Swap every two adjacent nodes */
-void q_swap(struct list_head *head)
+static __LIST_ALWAYS_INLINE void merge_sift_down(merge_src_t *heap,
+                                                 int k,
+                                                 int i,
+                                                 bool descend)
 {
-    return q_reverseK(head, 2);
+    merge_src_t tmp = heap[i];
+
+    while (2 * i + 1 < k) {
+        int child = 2 * i + 1;
+        if (child + 1 < k &&
+            merge_before(&heap[child + 1], &heap[child], descend))
+            child++;
+        if (!merge_before(&heap[child], &tmp, descend))
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = tmp;
 }
 
-/* Reverse elements in queue */
-void q_reverse(struct list_head *head)
+/* Merge k sorted sources into the empty list head through a binary heap, in
+ * the direction given as a constant by q_merge_heap() */
+static __LIST_ALWAYS_INLINE void q_merge_heap_dir(struct list_head *head,
+                                                  merge_src_t *heap,
+                                                  int k,
+                                                  bool descend)
 {
-    if (!head || list_empty(head))
-        return;
+    struct list_head *prev = head;
 
-    struct list_head *L, *R;
+    for (int i = k / 2 - 1; i >= 0; i--)
+        merge_sift_down(heap, k, i, descend);
 
-    list_for_each_safe(L, R, head) {
-        L->next = L->prev;
-        L->prev = R;
+    while (k > 1) {
+        struct list_head *node = heap[0].node;
+        heap[0].node = node->next;
+        if (heap[0].node == heap[0].end)
+            heap[0] = heap[--k];
+        merge_sift_down(heap, k, 0, descend);
+
+        prev->next = node;
+        node->prev = prev;
+        prev = node;
     }
 
-    head->next = head->prev;
-    head->prev = R;
+    /* The last source is linked as a whole */
+    if (k) {
+        prev->next = heap[0].node;
+        heap[0].node->prev = prev;
+        prev = heap[0].end->prev;
+    }
+    prev->next = head;
+    head->prev = prev;
+}
 
-    return;
+static void q_merge_heap(struct list_head *head,
+                         merge_src_t *heap,
+                         int k,
+                         bool descend)
+{
+    if (descend)
+        q_merge_heap_dir(head, heap, k, true);
+    else
+        q_merge_heap_dir(head, heap, k, false);
 }
 
-/* Reverse the nodes of the list k at a time */
-void q_reverseK(struct list_head *head, int k)
+/* Merge the sorted list src into the sorted list dst, ties taken from dst */
+static void q_merge_two(struct list_head *dst,
+                        struct list_head *src,
+                        bool descend)
 {
-    if (!head || list_empty(head) || list_is_singular(head) || k == 1)
+    if (list_empty(dst)) {
+        list_splice_init(src, dst);
         return;
+    }
 
-    LIST_HEAD(rev_list);
-    LIST_HEAD(new_head);
-    struct list_head *cut;
-    int group = q_size(head) / k;
+    dst->prev->next = NULL;
+    src->prev->next = NULL;
+    relink_chain(dst, q_merge_chains(dst->next, src->next, descend));
+    INIT_LIST_HEAD(src);
+}
 
-    while (group--) {
-        int count = 0;
-        list_for_each(cut, head) {
-            count++;
-            if (count == k)
-                break;
+/* Merge adjacent non-empty queues of the chain in rounds until only one of
+ * them is left, which takes log k passes over the elements.
+ */
+static void q_merge_pairwise(struct list_head *head, bool descend)
+{
+    bool merged = true;
+
+    while (merged) {
+        queue_contex_t *ctx, *pending = NULL;
+
+        merged = false;
+        list_for_each_entry(ctx, head, chain) {
+            if (list_empty(ctx->q))
+                continue;
+            if (!pending) {
+                pending = ctx;
+                continue;
+            }
+            q_merge_two(pending->q, ctx->q, descend);
+            pending = NULL;
+            merged = true;
         }
-        list_cut_position(&rev_list, head, cut);
-        q_reverse(&rev_list);
-        list_splice_tail_init(&rev_list, &new_head);
     }
-    list_splice_init(&new_head, head);
-
-    return;
 }
 
-
-struct list_head *q_mergelists(struct list_head *list1, struct list_head *list2)
+/* Merge all the queues into one sorted queue, which is in ascending/descending
+ * order */
+int q_merge(struct list_head *head, bool descend)
 {
-    struct list_head *new_head = NULL, **indirect = &new_head;
+    if (!head || list_empty(head))
+        return 0;
 
-    while (true) {
-        if (!list1) {
-            *indirect = list2;
-            break;
+    queue_contex_t *first = list_first_entry(head, queue_contex_t, chain);
+    queue_contex_t *ctx;
+
+    if (list_is_singular(head))
+        return first->size;
+
+    queue_head_t *merged_q = q_header(first->q);
+    int k = 0, total = 0;
+
+    list_for_each_entry(ctx, head, chain) {
+        queue_head_t *cur_q = q_header(ctx->q);
+
+        slots_leave(ctx->q);
+        total += cur_q->size;
+        if (!list_empty(ctx->q))
+            k++;
+        if (ctx == first)
+            continue;
+
+        /* Arena elements must outlive the queue they were carved from */
+        list_splice_tail_init(&cur_q->chunks, &merged_q->chunks);
+        if (!list_empty(ctx->q) &&
+            (merged_q->arena != cur_q->arena || cur_q->mixed))
+            merged_q->mixed = true;
+        first->size += ctx->size;
+        ctx->size = 0;
+        cur_q->size = 0;
+    }
+
+    if (k <= MERGE_HEAP_MAX) {
+        merge_src_t heap[MERGE_HEAP_MAX];
+        LIST_HEAD(first_list);
+        int i = 0;
+
+        list_splice_init(first->q, &first_list);
+        list_for_each_entry(ctx, head, chain) {
+            struct list_head *q = ctx == first ? &first_list : ctx->q;
+            if (list_empty(q))
+                continue;
+            heap[i].node = q->next;
+            heap[i].end = q;
+            heap[i].order = i;
+            i++;
         }
-        if (!list2) {
-            *indirect = list1;
-            break;
+        q_merge_heap(first->q, heap, k, descend);
+        list_for_each_entry(ctx, head, chain) {
+            if (ctx != first)
+                INIT_LIST_HEAD(ctx->q);
         }
-        const char *str1 = list_entry(list1, element_t, list)->value,
-                   *str2 = list_entry(list2, element_t, list)->value;
-        if (strcmp(str1, str2) < 0) {
-            *indirect = list1;
-            list1 = list1->next;
-        } else {
-            *indirect = list2;
-            list2 = list2->next;
+    } else {
+        /* The result is left in the first non-empty queue */
+        q_merge_pairwise(head, descend);
+        list_for_each_entry(ctx, head, chain) {
+            if (ctx != first)
+                list_splice_init(ctx->q, first->q);
         }
-        indirect = &(*indirect)->next;
     }
-    return new_head;
-}
+    merged_q->size = total;
 
+    return first->size;
+}
 
+/* Bytes a snapshot record holding a string of len bytes takes up, without
+ * the terminating null byte */
+static inline size_t snapshot_record_size(size_t len)
+{
+    return sizeof(uint32_t) + ((len + 1 + 3) & ~(size_t) 3);
+}
 
-/* Sort elements of queue in ascending/descending order */
-void q_sort(struct list_head *head, bool descend)
+bool q_save(struct list_head *head, FILE *f)
 {
-    if (!head || list_empty(head) || list_is_singular(head))
-        return;
+    q_snapshot_queue_t hdr = {0, 0};
+    element_t *ele;
+
+    if (head) {
+        q_link(head);
+        list_for_each_entry(ele, head, list) {
+            hdr.count++;
+            hdr.bytes += snapshot_record_size(ele->len);
+        }
+    }
+    if (fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+        return false;
+    if (!hdr.count)
+        return true;
+
+    static const char pad[4];
+    list_for_each_entry_prefetch(ele, head, list, value) {
+        uint32_t len = ele->len;
+        size_t padding = snapshot_record_size(len) - sizeof(len) - (len + 1);
+        if (fwrite(&len, sizeof(len), 1, f) != 1 ||
+            fwrite(ele->value, 1, len + 1, f) != len + 1 ||
+            fwrite(pad, 1, padding, f) != padding)
+            return false;
+    }
+    return true;
+}
 
-    struct list_head *stack[32], *node, *safe;
-    unsigned int size[32];
+struct list_head *q_load(int fd, off_t *pos)
+{
+    q_snapshot_queue_t hdr;
+    struct stat st;
+
+    /* The smallest record holds an empty string */
+    if (pread(fd, &hdr, sizeof(hdr), *pos) != sizeof(hdr) ||
+        fstat(fd, &st) || hdr.count > INT_MAX ||
+        hdr.bytes < hdr.count * snapshot_record_size(0) ||
+        hdr.bytes > (uint64_t) (st.st_size - *pos - sizeof(hdr)))
+        return NULL;
 
-    int it = 0;
+    struct list_head *head = q_create(true, Q_LAYOUT_LIST);
+    if (!head)
+        return NULL;
 
-    list_for_each_safe(node, safe, head) {
-        node->next = NULL;
-        stack[it++] = node;
-        size[it - 1] = 1;
-        while ((it > 1) && (size[it - 1] == size[it - 2])) {
-            stack[it - 2] = q_mergelists(stack[it - 1], stack[it - 2]);
-            size[it - 2] *= 2;
-            it--;
+    /* The elements are carved in one chunk, which also owns the mapping */
+    queue_head_t *q = q_header(head);
+    size_t size = hdr.count * sizeof(element_t);
+    arena_chunk_t *chunk = malloc(sizeof(arena_chunk_t) + size);
+    if (!chunk) {
+        q_free(head);
+        return NULL;
+    }
+    chunk->used = chunk->cap = size;
+    chunk->map = NULL;
+    list_add(&chunk->list, &q->chunks);
+
+    off_t start = *pos + sizeof(hdr);
+    char *rec = NULL;
+    if (hdr.bytes) {
+        /* Mappings start on a page boundary */
+        off_t base = start - start % sysconf(_SC_PAGESIZE);
+        size_t len = start - base + hdr.bytes;
+        void *map =
+            mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, base);
+        if (map == MAP_FAILED) {
+            q_free(head);
+            return NULL;
         }
+        chunk->map = map;
+        chunk->map_len = len;
+        rec = (char *) map + (start - base);
     }
 
-    it--;
-    while (it >= 1) {
-        stack[it - 1] = q_mergelists(stack[it], stack[it - 1]);
-        it--;
-    }
+    const char *end = rec ? rec + hdr.bytes : NULL;
+    element_t *ele = (element_t *) chunk->data;
+    for (uint64_t i = 0; i < hdr.count; i++, ele++) {
+        uint32_t len;
+        if ((size_t) (end - rec) < sizeof(len))
+            break;
+        memcpy(&len, rec, sizeof(len));
+        char *value = rec + sizeof(len);
+        if ((size_t) (end - rec) < snapshot_record_size(len) ||
+            strnlen(value, len + 1) != len)
+            break;
 
-    INIT_LIST_HEAD(head);
-    node = stack[0];
-    while (node) {
-        safe = node->next;
-        list_add_tail(node, head);
-        node = safe;
+        ele->value = value;
+        ele->flags = Q_ELEM_ARENA;
+        element_cache(ele, len + 1);
+        list_add_tail(&ele->list, head);
+        rec += snapshot_record_size(len);
     }
-
-    if (descend) {
-        q_reverse(head);
+    if (rec != end) {
+        q_free(head);
+        return NULL;
     }
 
-    return;
+    q->size = hdr.count;
+    *pos = start + hdr.bytes;
+    return head;
 }
 
+/* Serializes the allocation and release of concurrent queue elements, since
+ * the allocator of the test harness is not thread-safe */
+static pthread_mutex_t cq_alloc_lock = PTHREAD_MUTEX_INITIALIZER;
 
-/* Remove every node which has a node with a strictly less value anywhere to
- * the right side of it */
-int q_ascend(struct list_head *head)
+/* Take lock, counting in contended the times it was held by another thread */
+static inline void cq_lock(pthread_mutex_t *lock, unsigned long *contended)
 {
-    if (!head || list_empty(head))
-        return 0;
+    if (pthread_mutex_trylock(lock)) {
+        __atomic_add_fetch(contended, 1, __ATOMIC_RELAXED);
+        pthread_mutex_lock(lock);
+    }
+}
 
-    if (list_is_singular(head))
-        return 1;
+cqueue_t *cq_new()
+{
+    cqueue_t *cq = malloc(sizeof(cqueue_t));
+    if (!cq)
+        return NULL;
 
-    struct list_head *R = head->prev, *L = head->prev->prev;
-    element_t *delete;
+    /* Timed waits are measured on the monotonic clock, immune to clock jumps */
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&cq->nonempty, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&cq->head_lock, NULL);
+    pthread_mutex_init(&cq->tail_lock, NULL);
+
+    cq->first.next = NULL;
+    cq->last = &cq->first;
+    cq->size = 0;
+    cq->waiters = 0;
+    cq->head_contended = cq->tail_contended = cq->waits = 0;
+    return cq;
+}
 
-    while (L != head) {
-        if (strcmp(list_entry(R, element_t, list)->value,
-                   list_entry(L, element_t, list)->value) > 0) {
-            L = L->prev;
-            R = R->prev;
-        } else {
-            delete = list_entry(L, element_t, list);
-            list_del_init(L);
-            free(delete->value);
-            free(delete);
-            L = R->prev;
-        }
-    }
+void cq_free(cqueue_t *cq)
+{
+    if (!cq)
+        return;
 
-    return q_size(head);
+    struct list_head *node = cq->first.next;
+    while (node) {
+        struct list_head *next = node->next;
+        q_release_element(list_entry(node, element_t, list));
+        node = next;
+    }
+    pthread_cond_destroy(&cq->nonempty);
+    pthread_mutex_destroy(&cq->head_lock);
+    pthread_mutex_destroy(&cq->tail_lock);
+    free(cq);
 }
 
-/* Remove every node which has a node with a strictly greater value anywhere to
- * the right side of it */
-int q_descend(struct list_head *head)
+bool cq_insert_tail(cqueue_t *cq, char *s)
 {
-    if (!head || list_empty(head))
-        return 0;
+    if (!cq)
+        return false;
 
-    if (list_is_singular(head))
-        return 1;
+    pthread_mutex_lock(&cq_alloc_lock);
+    element_t *ele = element_new(s, strlen(s) + 1);
+    pthread_mutex_unlock(&cq_alloc_lock);
+    if (!ele)
+        return false;
+    ele->list.next = NULL;
+    ele->list.prev = NULL;
+
+    cq_lock(&cq->tail_lock, &cq->tail_contended);
+    /* Publishes the element to a consumer reading the same pointer without
+     * the tail lock, and is ordered before the check for waiters below */
+    __atomic_store_n(&cq->last->next, &ele->list, __ATOMIC_SEQ_CST);
+    cq->last = &ele->list;
+    __atomic_add_fetch(&cq->size, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&cq->tail_lock);
+
+    /* A waiter registers before it looks at the queue, so either it sees the
+     * element or the element's producer sees it and wakes it up.
+     */
+    if (__atomic_load_n(&cq->waiters, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&cq->head_lock);
+        pthread_cond_signal(&cq->nonempty);
+        pthread_mutex_unlock(&cq->head_lock);
+    }
+    return true;
+}
 
-    struct list_head *R = head->prev, *L = head->prev->prev;
-    element_t *delete;
+/* Unlink the oldest element, with the head lock held */
+static element_t *cq_pop(cqueue_t *cq)
+{
+    struct list_head *node = __atomic_load_n(&cq->first.next, __ATOMIC_SEQ_CST);
+    if (!node)
+        return NULL;
 
-    while (L != head) {
-        if (strcmp(list_entry(R, element_t, list)->value,
-                   list_entry(L, element_t, list)->value) < 0) {
-            L = L->prev;
-            R = R->prev;
-        } else {
-            delete = list_entry(L, element_t, list);
-            list_del_init(L);
-            free(delete->value);
-            free(delete);
-            L = R->prev;
-        }
+    struct list_head *next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+    if (!next) {
+        /* node may be the newest element, which producers append to */
+        cq_lock(&cq->tail_lock, &cq->tail_contended);
+        next = node->next;
+        if (!next)
+            cq->last = &cq->first;
+        __atomic_store_n(&cq->first.next, next, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&cq->tail_lock);
+    } else {
+        __atomic_store_n(&cq->first.next, next, __ATOMIC_RELAXED);
     }
+    __atomic_sub_fetch(&cq->size, 1, __ATOMIC_RELAXED);
 
-    return q_size(head);
+    INIT_LIST_HEAD(node);
+    return list_entry(node, element_t, list);
 }
 
-/* Merge all the queues into one sorted queue, which is in ascending/descending
- * order */
-int q_merge(struct list_head *head, bool descend)
+element_t *cq_remove_head(cqueue_t *cq, char *sp, size_t bufsize)
 {
-    if (!head || list_empty(head))
-        return 0;
+    if (!cq)
+        return NULL;
 
-    queue_contex_t *merged = list_entry(head->next, queue_contex_t, chain);
-    struct list_head *merged_queue = merged->q;
+    cq_lock(&cq->head_lock, &cq->head_contended);
+    element_t *ele = cq_pop(cq);
+    pthread_mutex_unlock(&cq->head_lock);
 
-    if (list_is_singular(head))
-        return merged->size;
-
-    struct list_head *cur_chain = head->next->next;
-
-    while (cur_chain != head) {
-        queue_contex_t *cur_ctx = list_entry(cur_chain, queue_contex_t, chain);
-        struct list_head *cur_queue = cur_ctx->q;
-        if (!list_empty(cur_queue)) {
-            list_splice_tail(cur_queue, merged_queue);
-            merged->size += cur_ctx->size;
-            cur_ctx->size = 0;
-            INIT_LIST_HEAD(cur_queue);
+    if (ele)
+        element_copy(ele, sp, bufsize);
+    return ele;
+}
+
+element_t *cq_remove_head_wait(cqueue_t *cq,
+                               char *sp,
+                               size_t bufsize,
+                               int timeout_ms)
+{
+    if (!cq)
+        return NULL;
+
+    struct timespec deadline;
+    if (timeout_ms > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (long) (timeout_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
         }
-        cur_chain = cur_chain->next;
     }
 
-    q_sort(merged_queue, descend);
+    cq_lock(&cq->head_lock, &cq->head_contended);
+    __atomic_add_fetch(&cq->waiters, 1, __ATOMIC_SEQ_CST);
+    element_t *ele;
+    int err = 0;
+    while (!(ele = cq_pop(cq)) && timeout_ms && err != ETIMEDOUT) {
+        __atomic_add_fetch(&cq->waits, 1, __ATOMIC_RELAXED);
+        if (timeout_ms < 0)
+            pthread_cond_wait(&cq->nonempty, &cq->head_lock);
+        else
+            err = pthread_cond_timedwait(&cq->nonempty, &cq->head_lock,
+                                         &deadline);
+    }
+    __atomic_sub_fetch(&cq->waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&cq->head_lock);
+
+    if (ele)
+        element_copy(ele, sp, bufsize);
+    return ele;
+}
 
-    return merged->size;
+void cq_release_element(element_t *e)
+{
+    pthread_mutex_lock(&cq_alloc_lock);
+    q_release_element(e);
+    pthread_mutex_unlock(&cq_alloc_lock);
+}
+
+int cq_size(cqueue_t *cq)
+{
+    return cq ? __atomic_load_n(&cq->size, __ATOMIC_RELAXED) : 0;
 }
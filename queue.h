@@ -7,24 +7,98 @@
  * It uses a circular doubly-linked list to represent the set of queue elements
  */
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
 
 #include "harness.h"
 #include "list.h"
 
+/* Strings shorter than this are stored inside the element itself. The size
+ * fills the tail padding of element_t on LP64 targets, keeping it 48 bytes.
+ */
+#define Q_INLINE_LEN 12
+
 /**
  * element_t - Linked list element
  * @value: pointer to array holding string
  * @list: node of a doubly-linked list
- *
- * @value needs to be explicitly allocated and freed
+ * @flags: how the element and @value were allocated, see Q_ELEM_*
+ * @len: length of @value, without the terminating null byte
+ * @prefix: first 4 bytes of @value, big-endian and zero padded, so that
+ *          comparing prefixes orders elements like strcmp() on a mismatch
+ * @inline_value: storage @value points to for short strings
+ *
+ * @value needs to be explicitly allocated and freed, unless it points to
+ * @inline_value. @len and @prefix are filled in when the element is created
+ * and must be kept in sync if @value is ever changed.
  */
 typedef struct {
     char *value;
     struct list_head list;
+    unsigned int flags;
+    unsigned int len;
+    uint32_t prefix;
+    char inline_value[Q_INLINE_LEN];
 } element_t;
 
+/* Element and its string are carved from the arena of the owning queue */
+#define Q_ELEM_ARENA 0x1
+
+/* String is a shared copy from the intern table, see q_set_intern() */
+#define Q_ELEM_INTERNED 0x2
+
+/* Number of element pointers held by a block of an unrolled queue */
+#define Q_BLOCK_LEN 64
+
+/* Layouts of the elements of a queue */
+enum {
+    Q_LAYOUT_LIST,     /* linked to each other, see q_new() */
+    Q_LAYOUT_RING,     /* ring of element pointers, see q_new_ring() */
+    Q_LAYOUT_UNROLLED, /* list of blocks of pointers, see q_new_unrolled() */
+};
+
+/**
+ * queue_head_t - Header of a queue created by q_new()
+ * @head: head of the circular doubly-linked list holding the elements
+ * @size: number of elements in the queue
+ * @layout: one of the Q_LAYOUT_* layouts
+ * @arena: whether new elements are carved from @chunks
+ * @mixed: whether @head may hold elements that are not arena-backed, or that
+ *         hold interned strings
+ * @slots_valid: whether the ring or the blocks hold the elements in order
+ * @links_valid: whether the elements are linked to @head in queue order
+ * @chunks: memory chunks owned by the queue, see q_new_arena()
+ * @slots: ring of @cap element pointers, the first element is at @first
+ * @cap: number of entries in @slots, zero or a power of two
+ * @first: index of the first element in @slots
+ * @blocks: blocks of element pointers of an unrolled queue
+ * @spare: empty blocks kept for reuse by an unrolled queue
+ *
+ * The queue is handed around as a pointer to @head, which must stay the first
+ * member. Every operation in queue.c keeps @size up to date, so that q_size()
+ * is O(1). Code that links, unlinks or reorders nodes without going through
+ * the q_* operations has to report the change with q_size_adjust().
+ *
+ * A list queue always has @links_valid set. Ring and unrolled queues have at
+ * least one of @slots_valid and @links_valid set, and move their elements
+ * between the two representations on demand.
+ */
+typedef struct {
+    struct list_head head;
+    int size;
+    int layout;
+    bool arena, mixed;
+    bool slots_valid, links_valid;
+    struct list_head chunks;
+    element_t **slots;
+    unsigned int cap, first;
+    struct list_head blocks, spare;
+} queue_head_t;
+
 /**
  * queue_contex_t - The context managing a chain of queues
  * @q: pointer to the head of the queue
@@ -48,6 +122,77 @@ typedef struct {
  */
 struct list_head *q_new();
 
+/**
+ * q_new_arena() - Create an empty queue that allocates from an arena
+ *
+ * Elements inserted into the queue are carved, together with their strings,
+ * out of large chunks obtained from test_malloc(), so an insertion usually
+ * costs no allocator call and q_free() releases the queue in O(chunks).
+ *
+ * The memory of an element removed from the queue is only reclaimed when the
+ * queue is freed: q_release_element() does nothing for arena elements, and
+ * such elements must not be used after their queue is gone.
+ *
+ * Return: NULL for allocation failed
+ */
+struct list_head *q_new_arena();
+
+/**
+ * q_new_ring() - Create an empty queue backed by a ring of element pointers
+ *
+ * The elements are kept in a growable power-of-two array instead of being
+ * linked to each other, so that inserting at either end, removing from either
+ * end, and q_reverse(), q_reverseK(), q_swap() and q_sort() work on the array
+ * and never touch neighbouring elements. The other operations link the
+ * elements first, and the ring is rebuilt by the next operation that uses it.
+ *
+ * The links of a ring queue are only kept up to date on request: call
+ * q_link() before walking it with the list.h API.
+ *
+ * Return: NULL for allocation failed
+ */
+struct list_head *q_new_ring();
+
+/**
+ * q_new_unrolled() - Create an empty queue backed by an unrolled list
+ *
+ * The elements are kept in a linked list of blocks, each holding up to
+ * Q_BLOCK_LEN element pointers between a head and a tail offset. Inserting
+ * and removing at either end stay O(1), walking the queue visits the element
+ * pointers nearly sequentially, and q_delete_mid() only shifts pointers within
+ * one block. Like for a ring queue, the operations that q_new_ring() lists and
+ * q_delete_mid() work on the blocks, the others on the links, and q_link() has
+ * to be called before walking the queue with the list.h API.
+ *
+ * Return: NULL for allocation failed
+ */
+struct list_head *q_new_unrolled();
+
+/**
+ * q_link() - Link the elements of a ring or unrolled queue in queue order
+ * @head: header of queue
+ *
+ * Afterwards the queue can be walked with the list.h API until the next q_*
+ * operation on it. Code that goes on to rearrange the nodes has to report it
+ * with q_size_adjust(), so that the ring or the blocks are rebuilt from the
+ * list. Takes O(n) for a queue whose elements are not linked yet, and has no
+ * effect on list queues or if queue is NULL.
+ */
+void q_link(struct list_head *head);
+
+/**
+ * q_peek() - Look at an element without removing it
+ * @head: header of queue
+ * @i: position of the element, counted from the head when not negative, and
+ *     from the tail otherwise, -1 being the last element
+ *
+ * Takes O(1) for ring queues, and walks to the element from the closer end
+ * of other queues, block by block for unrolled ones.
+ *
+ * Return: the element, %NULL if queue is NULL or @i is out of range
+ */
+element_t *q_peek(struct list_head *head, int i);
+
 /**
  * q_free() - Free all storage used by queue, no effect if header is NULL
  * @head: header of queue
@@ -78,6 +223,41 @@ bool q_insert_head(struct list_head *head, char *s);
  */
 bool q_insert_tail(struct list_head *head, char *s);
 
+/**
+ * q_insert_head_n() - Insert many elements at head of queue
+ * @head: header of queue
+ * @sv: strings to be copied
+ * @nstr: number of strings in @sv
+ * @n: number of elements to insert
+ *
+ * Element i holds a copy of @sv[i % @nstr], so @nstr == @n inserts an array of
+ * strings and @nstr == 1 repeats one string. The result is the same as calling
+ * q_insert_head() for each element in turn. All the elements and their strings
+ * are carved out of one block owned by the queue, like those of an arena
+ * queue, and released by q_free(). The block is kept until then even once all
+ * of its elements have been removed, so a long-lived queue that is refilled
+ * with these functions grows until it is freed.
+ *
+ * Return: true for success, false if no element was inserted because the
+ * queue is NULL, the arguments are invalid, or allocation failed
+ */
+bool q_insert_head_n(struct list_head *head, char **sv, int nstr, int n);
+
+/**
+ * q_insert_tail_n() - Insert many elements at tail of queue
+ * @head: header of queue
+ * @sv: strings to be copied
+ * @nstr: number of strings in @sv
+ * @n: number of elements to insert
+ *
+ * Like q_insert_head_n(), with the result of calling q_insert_tail() for each
+ * element in turn.
+ *
+ * Return: true for success, false if no element was inserted because the
+ * queue is NULL, the arguments are invalid, or allocation failed
+ */
+bool q_insert_tail_n(struct list_head *head, char **sv, int nstr, int n);
+
 /**
  * q_remove_head() - Remove the element from head of queue
  * @head: header of queue
@@ -108,6 +288,64 @@ element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize);
  */
 element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize);
 
+/**
+ * q_detach_head() - Remove the element from head of queue, without copying
+ * its string
+ * @head: header of queue
+ *
+ * Same as q_remove_head() with a NULL @sp: the string is left untouched in
+ * the element, for the caller to read in place or take with q_take_value().
+ *
+ * Return: the pointer to element, %NULL if queue is NULL or empty.
+ */
+element_t *q_detach_head(struct list_head *head);
+
+/**
+ * q_detach_tail() - Remove the element from tail of queue, without copying
+ * its string
+ * @head: header of queue
+ *
+ * Return: the pointer to element, %NULL if queue is NULL or empty.
+ */
+element_t *q_detach_tail(struct list_head *head);
+
+/**
+ * q_take_value() - Release a removed element, keeping its string
+ * @e: element removed from its queue
+ *
+ * A string allocated on its own is handed over as is. Strings stored inside
+ * the element, or carved from an arena or a snapshot mapping, do not outlive
+ * the element and are copied into a new allocation.
+ *
+ * Return: the string, which the caller frees with free(). %NULL if @e is NULL
+ * or copying failed, in which case @e is left as it was.
+ */
+char *q_take_value(element_t *e);
+
+/**
+ * q_set_intern() - Choose whether inserted strings are interned
+ * @enable: whether elements share one copy of each distinct string
+ *
+ * In interning mode, q_insert_head() and q_insert_tail() look strings too
+ * long to be stored inside the element up in a global table, and point the
+ * new element at the table's reference-counted copy, allocating one only for
+ * a string not seen before. Interned strings must not be changed in place,
+ * and elements holding equal interned strings are compared by pointer. The
+ * mode only affects elements inserted afterwards. The bulk insertions look
+ * each distinct string up once and take all of its references together.
+ * Arena queues keep copying their strings.
+ */
+void q_set_intern(bool enable);
+
+/**
+ * q_intern_release() - Drop a reference to an interned string
+ * @value: string of an element flagged Q_ELEM_INTERNED
+ *
+ * The copy is freed along with its last reference. This function is intended
+ * for internal use only.
+ */
+void q_intern_release(char *value);
+
 /**
  * q_release_element() - Release the element
  * @e: element would be released
@@ -116,10 +354,54 @@ element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize);
  */
 static inline void q_release_element(element_t *e)
 {
-    test_free(e->value);
+    if (e->flags & Q_ELEM_INTERNED)
+        q_intern_release(e->value);
+    /* Arena elements are reclaimed together with their queue */
+    if (e->flags & Q_ELEM_ARENA)
+        return;
+    if (!(e->flags & Q_ELEM_INTERNED) && e->value != e->inline_value)
+        test_free(e->value);
     test_free(e);
 }
 
+/**
+ * q_remove_head_n() - Remove up to n elements from head of queue at once
+ * @head: header of queue
+ * @list: initialized list head the removed elements are appended to
+ * @n: maximum number of elements to remove
+ *
+ * The removed elements keep their order and are moved with a single cut of the
+ * list, after walking to the n-th node from whichever end of the queue is
+ * closer. As with q_remove_head(), the caller is responsible for releasing
+ * them, e.g. with q_release_element().
+ *
+ * Return: the number of elements removed, 0 if queue is NULL or empty
+ */
+int q_remove_head_n(struct list_head *head, struct list_head *list, int n);
+
+/**
+ * q_remove_head_copy_n() - Remove up to n elements and pack their strings
+ * @head: header of queue
+ * @list: initialized list head the removed elements are appended to
+ * @n: maximum number of elements to remove
+ * @buf: buffer the strings are packed into
+ * @bufsize: size of @buf
+ * @offsets: array of at least @n entries
+ *
+ * Like q_remove_head_n(), and also copies the string of the i-th removed
+ * element with its terminating null byte to @buf + @offsets[i], back to back.
+ * Removal stops before the first element whose string does not fit entirely
+ * into the rest of @buf.
+ *
+ * Return: the number of elements removed, 0 if queue is NULL or empty
+ */
+int q_remove_head_copy_n(struct list_head *head,
+                         struct list_head *list,
+                         int n,
+                         char *buf,
+                         size_t bufsize,
+                         size_t *offsets);
+
 /**
  * q_size() - Get the size of the queue
  * @head: header of queue
@@ -128,6 +410,29 @@ static inline void q_release_element(element_t *e)
  */
 int q_size(struct list_head *head);
 
+/**
+ * q_size_adjust() - Account for nodes spliced into or out of the queue
+ * @head: header of queue
+ * @delta: number of elements added (positive) or removed (negative)
+ *
+ * Callers splicing raw list_head chains into or out of a queue, e.g. with
+ * list_splice() or list_cut_position(), must report the change here to keep
+ * the cached element count correct. Callers that only reorder the nodes
+ * report a @delta of zero, which makes a ring queue rebuild its ring from the
+ * list. No effect if queue is NULL.
+ */
+void q_size_adjust(struct list_head *head, int delta);
+
+/**
+ * q_size_sync() - Recompute the cached element count by walking the queue
+ * @head: header of queue
+ *
+ * Useful when the number of nodes moved by raw list operations is unknown.
+ *
+ * Return: the number of elements in queue, zero if queue is NULL or empty
+ */
+int q_size_sync(struct list_head *head);
+
 /**
  * q_delete_mid() - Delete the middle node in queue
  * @head: header of queue
@@ -200,6 +505,75 @@ void q_reverseK(struct list_head *head, int k);
  */
 void q_sort(struct list_head *head, bool descend);
 
+/**
+ * q_sort_scratch_size() - Bytes of working memory q_sort() can make use of
+ * @n: number of elements in the queue to be sorted
+ *
+ * Return: the size of the buffer to pass to q_sort_set_scratch()
+ */
+size_t q_sort_scratch_size(int n);
+
+/**
+ * q_sort_set_scratch() - Provide working memory for q_sort()
+ * @buf: buffer of @size bytes, or NULL to withdraw it
+ * @size: size of @buf in bytes
+ *
+ * q_sort() must not allocate. When a buffer of at least
+ * q_sort_scratch_size(n) bytes has been provided for a queue of n elements,
+ * the array-based engines gather an 8-byte key prefix and the node of every
+ * element into a contiguous array, sort that array, only looking at the full
+ * strings on prefix ties, and relink the list once. Otherwise q_sort() falls
+ * back to sorting the list in place.
+ *
+ * Either way, sorted and strictly reverse sorted queues are not sorted again.
+ * The array-based engines also keep a leading run of at least a quarter of the
+ * queue, such as a sorted queue with a few elements appended, and only sort the
+ * elements after it before merging the two.
+ *
+ * The buffer stays in use until it is withdrawn.
+ */
+void q_sort_set_scratch(void *buf, size_t size);
+
+/* Sort engines selectable with q_sort_set_engine() */
+enum {
+    Q_SORT_AUTO,     /* pick one of the engines below by queue size */
+    Q_SORT_LIST,     /* merge sort relinking the list in place */
+    Q_SORT_PREFIX,   /* merge sort over gathered key prefixes */
+    Q_SORT_RADIX,    /* MSD radix sort over gathered key prefixes */
+    Q_SORT_PARALLEL, /* segments sorted and merged on worker threads */
+};
+
+/* Upper bound of the thread count accepted by q_sort_set_threads() */
+#define Q_SORT_MAX_THREADS 64
+
+/**
+ * q_sort_set_engine() - Select the algorithm used by q_sort()
+ * @engine: one of the Q_SORT_* engines
+ *
+ * Every engine is stable and sorts in the requested direction. The array-based
+ * engines need working memory, see q_sort_set_scratch(); without it q_sort()
+ * falls back to Q_SORT_LIST. Q_SORT_AUTO, the default, keeps the list sort for
+ * small queues and switches to the prefix and then the radix sort as the queue
+ * grows, or to the parallel sort for large queues when more than one thread is
+ * allowed.
+ *
+ * Return: false if @engine is unknown, leaving the selection unchanged
+ */
+bool q_sort_set_engine(int engine);
+
+/**
+ * q_sort_set_threads() - Set the number of threads used by Q_SORT_PARALLEL
+ * @threads: number of threads, including the calling one
+ *
+ * The parallel sort splits the queue into @threads segments, sorts them on
+ * worker threads with the best single-threaded engine available, and merges
+ * the sorted segments pairwise in a tree. With a single thread it behaves like
+ * Q_SORT_AUTO.
+ *
+ * Return: false if @threads is out of range, leaving the setting unchanged
+ */
+bool q_sort_set_threads(int threads);
+
 /**
  * q_ascend() - Delete every node which has a node with a strictly less
  * value anywhere to the right side of it.
@@ -230,6 +604,16 @@ int q_ascend(struct list_head *head);
  */
 int q_descend(struct list_head *head);
 
+/**
+ * q_set_batch_free() - Choose how q_ascend() and q_descend() free nodes
+ * @enable: whether to free the removed nodes in bulk
+ *
+ * By default every removed node is freed as soon as it is unlinked. In batched
+ * mode the removed nodes are gathered into one detached chain which is freed
+ * after the pass, so that the allocator is entered in a single burst.
+ */
+void q_set_batch_free(bool enable);
+
 /**
  * q_merge() - Merge all the queues into one sorted queue, which is in
  * ascending/descending order.
@@ -242,6 +626,7 @@ int q_descend(struct list_head *head);
  * in this function. There is no need to free the 'queue_contex_t' and its
  * member 'q' since they will be released externally. However, q_merge() is
  * responsible for making the queues to be NULL-queue, except the first one.
+ * Elements that compare equal keep the order of the queues they come from.
  *
  * Reference:
  * https://leetcode.com/problems/merge-k-sorted-lists/
@@ -250,4 +635,156 @@ int q_descend(struct list_head *head);
  */
 int q_merge(struct list_head *head, bool descend);
 
+/* Snapshot files start with a q_snapshot_header_t, followed by one
+ * q_snapshot_queue_t and its records per queue. A record is the length of a
+ * string as a uint32_t, then the string and its terminator, padded to a
+ * multiple of 4 bytes. All numbers are in host byte order.
+ */
+#define Q_SNAPSHOT_MAGIC 0x504e5351 /* "QSNP" */
+#define Q_SNAPSHOT_VERSION 1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t queues;
+    uint32_t reserved;
+} q_snapshot_header_t;
+
+typedef struct {
+    uint64_t count; /* number of records */
+    uint64_t bytes; /* size of the records */
+} q_snapshot_queue_t;
+
+/**
+ * q_save() - Append a queue to a snapshot file
+ * @head: header of queue
+ * @f: file positioned where the queue goes
+ *
+ * Writes a q_snapshot_queue_t and one record per element, from head to tail.
+ * An empty or NULL queue is saved as an empty queue.
+ *
+ * Return: true for success, false if writing failed
+ */
+bool q_save(struct list_head *head, FILE *f);
+
+/**
+ * q_load() - Create a queue from a snapshot file
+ * @fd: snapshot file open for reading
+ * @pos: offset of the queue in the file, advanced past it on success
+ *
+ * The records are mapped into memory instead of being read, and the elements
+ * are carved in one block, like those of an arena queue, with their strings
+ * pointing into the mapping. The queue owns the mapping and unmaps it in
+ * q_free(), so the elements and their strings must not be used once that
+ * queue, or the queue it was merged into, is freed. The strings can be
+ * changed in place without affecting the file.
+ *
+ * Return: the queue, NULL if allocation or mapping failed or the records are
+ * malformed
+ */
+struct list_head *q_load(int fd, off_t *pos);
+
+/**
+ * cqueue_t - FIFO queue that several threads may use at once
+ * @head_lock: serializes the consumers, guards @first
+ * @tail_lock: serializes the producers, guards @last
+ * @nonempty: signaled under @head_lock when an element arrives for a waiter
+ * @first: sentinel whose next pointer is the oldest element, NULL if empty
+ * @last: node of the newest element, @first if empty
+ * @size: number of elements in the queue
+ * @waiters: consumers blocked in cq_remove_head_wait()
+ * @head_contended: times a consumer found @head_lock taken
+ * @tail_contended: times a producer found @tail_lock taken
+ * @waits: times a consumer went to sleep on an empty queue
+ *
+ * The elements are chained through the next pointers of their list nodes
+ * only. Producers and consumers take different locks, so they only meet when
+ * the queue holds at most one element: removing the last element takes
+ * @tail_lock as well, always after @head_lock. @size and the statistics are
+ * updated atomically and may be read at any time.
+ */
+typedef struct {
+    pthread_mutex_t head_lock, tail_lock;
+    pthread_cond_t nonempty;
+    struct list_head first;
+    struct list_head *last;
+    int size;
+    int waiters;
+    unsigned long head_contended, tail_contended, waits;
+} cqueue_t;
+
+/**
+ * cq_new() - Create an empty concurrent queue
+ *
+ * Return: NULL for allocation failed
+ */
+cqueue_t *cq_new();
+
+/**
+ * cq_free() - Free all storage used by a concurrent queue
+ * @cq: concurrent queue, which no other thread may be using anymore
+ *
+ * No effect if @cq is NULL.
+ */
+void cq_free(cqueue_t *cq);
+
+/**
+ * cq_insert_tail() - Insert an element at the tail, from any thread
+ * @cq: concurrent queue
+ * @s: string would be inserted
+ *
+ * Wakes up a consumer waiting in cq_remove_head_wait(), if any.
+ *
+ * Return: true for success, false for allocation failed or @cq is NULL
+ */
+bool cq_insert_tail(cqueue_t *cq, char *s);
+
+/**
+ * cq_remove_head() - Remove the element at the head, from any thread
+ * @cq: concurrent queue
+ * @sp: output buffer where the removed string is copied
+ * @bufsize: size of the string
+ *
+ * Like q_remove_head(), returns at once if the queue is empty.
+ *
+ * Return: the removed element, NULL if @cq is NULL or empty
+ */
+element_t *cq_remove_head(cqueue_t *cq, char *sp, size_t bufsize);
+
+/**
+ * cq_remove_head_wait() - Remove the element at the head, waiting for one
+ * @cq: concurrent queue
+ * @sp: output buffer where the removed string is copied
+ * @bufsize: size of the string
+ * @timeout_ms: longest time to wait for an element in milliseconds, forever
+ *              if negative
+ *
+ * Return: the removed element, NULL if @cq is NULL or the queue stayed empty
+ * until the timeout
+ */
+element_t *cq_remove_head_wait(cqueue_t *cq,
+                               char *sp,
+                               size_t bufsize,
+                               int timeout_ms);
+
+/**
+ * cq_release_element() - Release an element removed from a concurrent queue
+ * @e: element would be released
+ *
+ * Same as q_release_element(), but safe against the other threads inserting
+ * into or releasing elements of concurrent queues at the same time.
+ */
+void cq_release_element(element_t *e);
+
+/**
+ * cq_size() - Return the number of elements in a concurrent queue
+ * @cq: concurrent queue
+ *
+ * The count may be out of date by the time it is used if other threads are
+ * inserting or removing elements.
+ *
+ * Return: the number of elements, 0 if @cq is NULL
+ */
+int cq_size(cqueue_t *cq);
+
 #endif /* LAB0_QUEUE_H */
@@ -35,7 +35,18 @@ class Tracer:
         14: "trace-14-perf",
         15: "trace-15-perf",
         16: "trace-16-perf",
-        17: "trace-17-complexity"
+        17: "trace-17-complexity",
+        18: "trace-18-presorted",
+        19: "trace-19-reverseK",
+        20: "trace-20-keys",
+        21: "trace-21-ring",
+        22: "trace-22-unrolled",
+        23: "trace-23-concurrent",
+        24: "trace-24-snapshot",
+        25: "trace-25-detach",
+        26: "trace-26-intern",
+        27: "trace-27-harness",
+        28: "trace-28-complexity-remove"
     }
 
     traceProbs = {
@@ -55,10 +66,21 @@ class Tracer:
         14: "Trace-14",
         15: "Trace-15",
         16: "Trace-16",
-        17: "Trace-17"
+        17: "Trace-17",
+        18: "Trace-18",
+        19: "Trace-19",
+        20: "Trace-20",
+        21: "Trace-21",
+        22: "Trace-22",
+        23: "Trace-23",
+        24: "Trace-24",
+        25: "Trace-25",
+        26: "Trace-26",
+        27: "Trace-27",
+        28: "Trace-28"
     }
 
-    maxScores = [0, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 5]
+    maxScores = [0, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 5]
 
     RED = '\033[91m'
     GREEN = '\033[92m'
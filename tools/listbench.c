@@ -0,0 +1,216 @@
+/* Measure the traversal macros of list.h against their prefetching variants.
+ *
+ * The nodes and their strings are allocated in one order and linked in a
+ * shuffled one, so that every step of a walk lands on a cold cache line as
+ * it does in a queue that has seen many insertions and removals.
+ *
+ * Usage: listbench [nodes] [rounds]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "list.h"
+
+typedef struct {
+    char *value;
+    struct list_head list;
+} item_t;
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t rng_next(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Allocate n items with strings of 16 to 47 bytes, link them in a random
+ * order
+ */
+static int build(struct list_head *head, item_t **items, size_t n)
+{
+    INIT_LIST_HEAD(head);
+    for (size_t i = 0; i < n; i++) {
+        size_t len = 16 + i % 32;
+        items[i] = malloc(sizeof(item_t));
+        if (!items[i])
+            return -1;
+        items[i]->value = malloc(len);
+        if (!items[i]->value)
+            return -1;
+        memset(items[i]->value, 'a' + i % 26, len - 1);
+        items[i]->value[len - 1] = '\0';
+    }
+
+    for (size_t i = n - 1; i > 0; i--) {
+        size_t j = rng_next() % (i + 1);
+        item_t *tmp = items[i];
+        items[i] = items[j];
+        items[j] = tmp;
+    }
+    for (size_t i = 0; i < n; i++)
+        list_add_tail(&items[i]->list, head);
+    return 0;
+}
+
+static size_t count_plain(struct list_head *head)
+{
+    struct list_head *node;
+    size_t n = 0;
+
+    list_for_each (node, head)
+        n++;
+    return n;
+}
+
+static size_t count_prefetch(struct list_head *head)
+{
+    struct list_head *node;
+    size_t n = 0;
+
+    list_for_each_prefetch(node, head)
+        n++;
+    return n;
+}
+
+static size_t read_plain(struct list_head *head)
+{
+    item_t *item;
+    size_t sum = 0;
+
+    list_for_each_entry(item, head, list)
+        sum += strlen(item->value);
+    return sum;
+}
+
+static size_t read_prefetch(struct list_head *head)
+{
+    item_t *item;
+    size_t sum = 0;
+
+    list_for_each_entry_prefetch(item, head, list, value)
+        sum += strlen(item->value);
+    return sum;
+}
+
+static size_t free_plain(struct list_head *head)
+{
+    item_t *item, *safe;
+    size_t n = 0;
+
+    list_for_each_entry_safe(item, safe, head, list) {
+        free(item->value);
+        free(item);
+        n++;
+    }
+    return n;
+}
+
+static size_t free_prefetch(struct list_head *head)
+{
+    item_t *item, *safe;
+    size_t n = 0;
+
+    list_for_each_entry_safe_prefetch(item, safe, head, list, value) {
+        free(item->value);
+        free(item);
+        n++;
+    }
+    return n;
+}
+
+typedef struct {
+    const char *name;
+    size_t (*plain)(struct list_head *);
+    size_t (*prefetch)(struct list_head *);
+    int consumes; /* whether the walk frees the list */
+} bench_t;
+
+static const bench_t benches[] = {
+    {"count", count_plain, count_prefetch, 0},
+    {"read", read_plain, read_prefetch, 0},
+    {"free", free_plain, free_prefetch, 1},
+};
+
+/* Time one walk over a freshly built list, in nanoseconds per node */
+static double run(size_t (*walk)(struct list_head *),
+                  int consumes,
+                  item_t **items,
+                  size_t n,
+                  size_t *check)
+{
+    struct list_head head;
+
+    if (build(&head, items, n) < 0) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    double start = now();
+    *check += walk(&head);
+    double elapsed = now() - start;
+
+    if (!consumes)
+        free_plain(&head);
+    return elapsed * 1e9 / n;
+}
+
+int main(int argc, char **argv)
+{
+    size_t n = argc > 1 ? strtoul(argv[1], NULL, 0) : 1 << 20;
+    int rounds = argc > 2 ? atoi(argv[2]) : 5;
+
+    if (n < 1 || rounds < 1) {
+        fprintf(stderr, "Usage: %s [nodes] [rounds]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    item_t **items = malloc(n * sizeof(item_t *));
+    if (!items) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("%zu nodes linked in shuffled order, best of %d rounds\n", n,
+           rounds);
+    for (size_t b = 0; b < sizeof(benches) / sizeof(benches[0]); b++) {
+        const bench_t *bench = &benches[b];
+        double best_plain = 0, best_prefetch = 0;
+        size_t check_plain = 0, check_prefetch = 0;
+
+        for (int r = 0; r < rounds; r++) {
+            double t = run(bench->plain, bench->consumes, items, n,
+                           &check_plain);
+            if (!r || t < best_plain)
+                best_plain = t;
+            t = run(bench->prefetch, bench->consumes, items, n,
+                    &check_prefetch);
+            if (!r || t < best_prefetch)
+                best_prefetch = t;
+        }
+
+        if (check_plain != check_prefetch) {
+            fprintf(stderr, "%s: walks disagree\n", bench->name);
+            return EXIT_FAILURE;
+        }
+        printf("%-6s %8.2f ns/node plain %8.2f ns/node prefetch  %.2fx\n",
+               bench->name, best_plain, best_prefetch,
+               best_plain / best_prefetch);
+    }
+
+    free(items);
+    return EXIT_SUCCESS;
+}
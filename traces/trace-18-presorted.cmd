@@ -0,0 +1,38 @@
+# Test performance of 'q_sort' on presorted input: 'q_new', 'q_insert_head', 'q_insert_tail', 'q_reverse', 'q_sort', and 'q_merge'
+# Sorted, reverse sorted and nearly sorted queues, including sorted queues with
+# random elements appended, are expected to take linear time
+option fail 0
+option malloc 0
+new
+ih RAND 300000
+sort
+time sort
+reverse
+time sort
+it aardvark 1000
+time sort
+it RAND 100
+time sort
+option descend 1
+time sort
+option descend 0
+free
+new
+ih RAND 150000
+sort
+new
+ih RAND 150000
+sort
+merge
+time sort
+free
+option sortalgo 1
+new
+ih RAND 300000
+sort
+time sort
+reverse
+time sort
+it aardvark 1000
+time sort
+free
@@ -0,0 +1,14 @@
+# Test performance of 'q_reverseK' and 'q_swap' on a large queue: 'q_new', 'q_insert_head', 'q_insert_tail', 'q_reverseK', 'q_swap', and 'q_size'
+# Every group size is expected to take linear time
+option fail 0
+option malloc 0
+new
+ih dolphin 500000
+it gerbil 500000
+time reverseK 2
+time reverseK 64
+time reverseK 4096
+time swap
+time reverseK 1000000
+size
+free
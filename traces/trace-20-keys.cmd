@@ -0,0 +1,10 @@
+# Test of the typed queue of 64-bit keys generated by DECLARE_QUEUE: sort and delete_dup
+option fail 0
+option malloc 0
+keys 1
+keys 2
+keys 1000
+time keys 200000
+option descend 1
+keys 1000
+time keys 200000
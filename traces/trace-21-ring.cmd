@@ -0,0 +1,28 @@
+# Test of a ring queue against a list queue: 'q_new_ring', 'q_insert_tail', 'q_sort', 'q_reverse', 'q_reverseK', 'q_swap', 'q_remove_head' and 'q_merge'
+# The same workload runs on both, compare the times of the two queues
+option fail 0
+option malloc 0
+new
+it RAND 300000
+time sort
+time reverse
+time reverseK 4
+time swap
+time rh * 300000
+time it dolphin 300000
+time rh dolphin 300000
+new ring
+it RAND 300000
+time sort
+time reverse
+time reverseK 4
+time swap
+time rh * 300000
+time it dolphin 300000
+time rh dolphin 300000
+it gerbil 10
+ih bear 10
+sort
+merge
+size
+free
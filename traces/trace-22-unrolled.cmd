@@ -0,0 +1,30 @@
+# Test of an unrolled queue against a list queue: 'q_new_unrolled', 'q_insert_head', 'q_insert_tail', 'q_sort', 'q_reverse', 'q_delete_mid', 'q_remove_head', 'q_remove_tail' and 'q_merge'
+# The same workload runs on both, compare the times of the two queues
+option fail 0
+option malloc 0
+new
+it RAND 300000
+ih RAND 100000
+time sort
+time reverse
+time dm
+time dm
+time rh * 200000
+time rt
+time rh * 199997
+new unrolled
+it RAND 300000
+ih RAND 100000
+time sort
+time reverse
+time dm
+time dm
+time rh * 200000
+time rt
+time rh * 199997
+it gerbil 10
+ih bear 10
+sort
+merge
+size
+free
@@ -0,0 +1,9 @@
+# Test of the concurrent queue: 'cq_new', 'cq_insert_tail', 'cq_remove_head_wait' and 'cq_free'
+# Producer and consumer threads pass elements through one queue, which must hand out the elements of each producer in order
+option fail 0
+option malloc 0
+mt 1 1 10000
+mt 4 1 20000
+mt 1 4 20000
+mt 4 4 100000
+mt 3 5 7
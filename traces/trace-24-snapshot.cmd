@@ -0,0 +1,27 @@
+# Test of saving queues to a snapshot file and loading them back: 'q_save', 'q_load', 'q_sort', 'q_merge' and 'q_free'
+option fail 0
+option malloc 0
+new
+it RAND 200000
+ih averyveryverylongstringvalue 1000
+new ring
+it dolphin 1000
+ih bear 1000
+save /tmp/lab0-trace-24.snap
+free
+free
+time load /tmp/lab0-trace-24.snap
+sort
+prev
+sort
+merge
+size
+free
+load /tmp/lab0-trace-24.snap
+save /tmp/lab0-trace-24.snap
+free
+free
+load /tmp/lab0-trace-24.snap remove
+size
+free
+free
@@ -0,0 +1,26 @@
+# Test of removal without copying: 'q_detach_head', 'q_detach_tail', 'q_take_value' and 'q_remove_head_n'
+option fail 0
+option malloc 0
+new
+ih averyveryverylongstringvalue
+ih gerbil
+it dolphinsandgerbilsandbears
+it bear
+rh *
+rt *
+rh *
+rt *
+option arena 1
+new
+it averyveryverylongstringvalue 3
+ih gerbil 3
+rh *
+rt *
+rh gerbil
+rt averyveryverylongstringvalue
+free
+option arena 0
+it RAND 300000
+time rh * 300000
+size
+free
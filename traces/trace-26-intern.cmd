@@ -0,0 +1,29 @@
+# Test of string interning: 'q_insert_head', 'q_insert_tail', 'q_sort', 'q_delete_dup', 'q_merge' and 'q_free' with shared strings
+option fail 0
+option malloc 0
+option intern 1
+new
+ih averyveryverylongstringvalue
+it averyveryverylongstringvalue
+ih dolphinsandgerbilsandbears 40
+it averyveryverylongstringvalue 50
+ih gerbil 40
+rh gerbil
+rt averyveryverylongstringvalue
+ih averyuniquelongstringvalue
+sort
+dedup
+size
+new
+it dolphinsandgerbilsandbears 3
+it zebrasandelephantsandlions 60
+sort
+merge
+size
+rh averyuniquelongstringvalue
+rh dolphinsandgerbilsandbears
+free
+option intern 0
+new
+it averyveryverylongstringvalue 5
+free
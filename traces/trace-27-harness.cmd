@@ -0,0 +1,21 @@
+# Test of 'option harness': the level cannot change while a queue is allocated
+option fail 0
+option malloc 0
+option harness 2
+new
+ih abcdefghijklmnopqrstuv
+option harness 0
+option harness 1
+free
+option harness 1
+new
+ih abcdefghijklmnopqrstuv
+option harness 0
+option harness 2
+free
+option harness 0
+new
+ih abcdefghijklmnopqrstuv
+option harness 1
+option harness 2
+free
@@ -0,0 +1,6 @@
+# Test if time complexity of 'q_detach_head' and 'q_detach_tail' is constant, and that of 'q_remove_head_n' only depends on n
+option simulation 1
+rh *
+rt *
+rh 16
+option simulation 0
@@ -0,0 +1,345 @@
+/* Queues of fixed-width values, specialized at compile time */
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "list.h"
+
+/**
+ * typed_queue_cmp_scalar() - Three-way comparison of two scalar values
+ * @a: pointer to the first value
+ * @b: pointer to the second value
+ *
+ * Suitable as the @cmp argument of DECLARE_QUEUE() for integer and pointer
+ * types.
+ */
+#define typed_queue_cmp_scalar(a, b) ((*(a) > *(b)) - (*(a) < *(b)))
+
+/**
+ * DECLARE_QUEUE() - Generate a queue of @type values named @name
+ * @name: prefix of the generated types and functions
+ * @type: type of the values, stored inline in every node
+ * @cmp: function or function-like macro taking two 'const @type *' and
+ *       returning a value less than, equal to, or greater than zero
+ *
+ * The generated queue follows the q_* operations of queue.h, except that the
+ * values are copied in and out of the nodes instead of being strings, and the
+ * queue is handed around as a 'struct @name *':
+ *
+ *   struct @name *@name_new(void);
+ *   void @name_free(struct @name *q);
+ *   bool @name_insert_head(struct @name *q, @type value);
+ *   bool @name_insert_tail(struct @name *q, @type value);
+ *   bool @name_remove_head(struct @name *q, @type *value);
+ *   bool @name_remove_tail(struct @name *q, @type *value);
+ *   int @name_size(const struct @name *q);
+ *   bool @name_delete_mid(struct @name *q);
+ *   bool @name_delete_dup(struct @name *q);
+ *   void @name_swap(struct @name *q);
+ *   void @name_reverse(struct @name *q);
+ *   void @name_reverseK(struct @name *q, int k);
+ *   void @name_sort(struct @name *q, bool descend);
+ *   int @name_ascend(struct @name *q);
+ *   int @name_descend(struct @name *q);
+ *   int @name_merge(struct @name *q, struct @name *other, bool descend);
+ *
+ * @name_remove_head() and @name_remove_tail() store the removed value to
+ * @value unless it is NULL. @name_merge() merges two queues sorted in the
+ * same order into @q, leaving @other empty, and returns the resulting size.
+ *
+ * @cmp is expanded in place, so sorting and removing duplicates compare the
+ * values without any call through a pointer or access to separate storage.
+ * Sorting and merging are list_sort() and list_merge() of list.h, inlined
+ * with a comparator generated per direction.
+ * Nodes come from malloc(), hence the harness when queue.h is included first.
+ *
+ * Example, for 64-bit identifiers and 16-byte keys:
+ *
+ *   DECLARE_QUEUE(idq, uint64_t, typed_queue_cmp_scalar)
+ *
+ *   typedef struct { unsigned char b[16]; } key_t;
+ *   static inline int key_cmp(const key_t *a, const key_t *b)
+ *   {
+ *       return memcmp(a->b, b->b, sizeof(a->b));
+ *   }
+ *   DECLARE_QUEUE(keyq, key_t, key_cmp)
+ */
+#define DECLARE_QUEUE(name, type, cmp)                                        \
+    struct name {                                                             \
+        struct list_head head;                                                \
+        int size;                                                             \
+    };                                                                        \
+                                                                              \
+    typedef struct {                                                          \
+        type value;                                                           \
+        struct list_head list;                                                \
+    } name##_element_t;                                                       \
+                                                                              \
+    static inline type *name##_value(struct list_head *node)                  \
+    {                                                                         \
+        return &list_entry(node, name##_element_t, list)->value;              \
+    }                                                                         \
+                                                                              \
+    /* Whether @b has to be placed before @a */                               \
+    static inline bool name##_after(struct list_head *a, struct list_head *b, \
+                                    bool descend)                             \
+    {                                                                         \
+        int c = cmp(name##_value(a), name##_value(b));                        \
+        return descend ? c < 0 : c > 0;                                       \
+    }                                                                         \
+                                                                              \
+    static inline void name##_release(struct list_head *node)                 \
+    {                                                                         \
+        free(list_entry(node, name##_element_t, list));                       \
+    }                                                                         \
+                                                                              \
+    static inline struct name *name##_new(void)                               \
+    {                                                                         \
+        struct name *q = malloc(sizeof(*q));                                  \
+        if (!q)                                                               \
+            return NULL;                                                      \
+        INIT_LIST_HEAD(&q->head);                                             \
+        q->size = 0;                                                          \
+        return q;                                                             \
+    }                                                                         \
+                                                                              \
+    static inline void name##_free(struct name *q)                            \
+    {                                                                         \
+        if (!q)                                                               \
+            return;                                                           \
+        struct list_head *node, *safe;                                        \
+        list_for_each_safe (node, safe, &q->head)                             \
+            name##_release(node);                                             \
+        free(q);                                                              \
+    }                                                                         \
+                                                                              \
+    static inline bool name##_insert_head(struct name *q, type value)         \
+    {                                                                         \
+        if (!q)                                                               \
+            return false;                                                     \
+        name##_element_t *ele = malloc(sizeof(*ele));                         \
+        if (!ele)                                                             \
+            return false;                                                     \
+        ele->value = value;                                                   \
+        list_add(&ele->list, &q->head);                                       \
+        q->size++;                                                            \
+        return true;                                                          \
+    }                                                                         \
+                                                                              \
+    static inline bool name##_insert_tail(struct name *q, type value)         \
+    {                                                                         \
+        if (!q)                                                               \
+            return false;                                                     \
+        name##_element_t *ele = malloc(sizeof(*ele));                         \
+        if (!ele)                                                             \
+            return false;                                                     \
+        ele->value = value;                                                   \
+        list_add_tail(&ele->list, &q->head);                                  \
+        q->size++;                                                            \
+        return true;                                                          \
+    }                                                                         \
+                                                                              \
+    static inline bool name##_remove_node(struct name *q,                     \
+                                          struct list_head *node, type *value) \
+    {                                                                         \
+        if (value)                                                            \
+            *value = *name##_value(node);                                     \
+        list_del(node);                                                       \
+        name##_release(node);                                                 \
+        q->size--;                                                            \
+        return true;                                                          \
+    }                                                                         \
+                                                                              \
+    static inline bool name##_remove_head(struct name *q, type *value)        \
+    {                                                                         \
+        if (!q || list_empty(&q->head))                                       \
+            return false;                                                     \
+        return name##_remove_node(q, q->head.next, value);                    \
+    }                                                                         \
+                                                                              \
+    static inline bool name##_remove_tail(struct name *q, type *value)        \
+    {                                                                         \
+        if (!q || list_empty(&q->head))                                       \
+            return false;                                                     \
+        return name##_remove_node(q, q->head.prev, value);                    \
+    }                                                                         \
+                                                                              \
+    static inline int name##_size(const struct name *q)                       \
+    {                                                                         \
+        return q ? q->size : 0;                                               \
+    }                                                                         \
+                                                                              \
+    static inline bool name##_delete_mid(struct name *q)                      \
+    {                                                                         \
+        if (!q || list_empty(&q->head))                                       \
+            return false;                                                     \
+        struct list_head *node = q->head.next;                                \
+        for (int i = (q->size - 1) / 2; i > 0; i--)                           \
+            node = node->next;                                                \
+        return name##_remove_node(q, node, NULL);                             \
+    }                                                                         \
+                                                                              \
+    /* Delete every node whose value occurs more than once in a row */        \
+    static inline bool name##_delete_dup(struct name *q)                      \
+    {                                                                         \
+        if (!q || list_empty(&q->head))                                       \
+            return false;                                                     \
+        struct list_head *node = q->head.next;                                \
+        while (node != &q->head) {                                            \
+            struct list_head *next = node->next;                              \
+            if (next == &q->head ||                                           \
+                cmp(name##_value(node), name##_value(next))) {                \
+                node = next;                                                  \
+                continue;                                                     \
+            }                                                                 \
+            while (next != &q->head &&                                        \
+                   !cmp(name##_value(node), name##_value(next))) {            \
+                struct list_head *dup = next;                                 \
+                next = next->next;                                            \
+                name##_remove_node(q, dup, NULL);                             \
+            }                                                                 \
+            name##_remove_node(q, node, NULL);                                \
+            node = next;                                                      \
+        }                                                                     \
+        return true;                                                          \
+    }                                                                         \
+                                                                              \
+    static inline void name##_swap(struct name *q)                            \
+    {                                                                         \
+        if (!q)                                                               \
+            return;                                                           \
+        for (struct list_head *node = q->head.next;                           \
+             node != &q->head && node->next != &q->head; node = node->next)   \
+            list_move(node, node->next);                                      \
+    }                                                                         \
+                                                                              \
+    static inline void name##_reverse(struct name *q)                         \
+    {                                                                         \
+        if (!q)                                                               \
+            return;                                                           \
+        struct list_head *node = &q->head;                                    \
+        do {                                                                  \
+            struct list_head *next = node->next;                              \
+            node->next = node->prev;                                          \
+            node->prev = next;                                                \
+            node = next;                                                      \
+        } while (node != &q->head);                                           \
+    }                                                                         \
+                                                                              \
+    static inline void name##_reverseK(struct name *q, int k)                 \
+    {                                                                         \
+        if (!q || k <= 1)                                                     \
+            return;                                                           \
+        struct list_head *start = &q->head;                                   \
+        for (int groups = q->size / k; groups > 0; groups--) {                \
+            struct list_head *first = start->next;                            \
+            for (int i = 1; i < k; i++)                                       \
+                list_move(first->next, start);                                \
+            start = first;                                                    \
+        }                                                                     \
+    }                                                                         \
+                                                                              \
+    /* Ascending order of the values for list_sort() */                       \
+    static inline int name##_cmp_ascend(void *priv,                           \
+                                        const struct list_head *a,            \
+                                        const struct list_head *b)            \
+    {                                                                         \
+        return cmp(&list_entry(a, name##_element_t, list)->value,             \
+                   &list_entry(b, name##_element_t, list)->value);            \
+    }                                                                         \
+                                                                              \
+    /* Descending order of the values for list_sort() */                      \
+    static inline int name##_cmp_descend(void *priv,                          \
+                                         const struct list_head *a,           \
+                                         const struct list_head *b)           \
+    {                                                                         \
+        return cmp(&list_entry(b, name##_element_t, list)->value,             \
+                   &list_entry(a, name##_element_t, list)->value);            \
+    }                                                                         \
+                                                                              \
+    /* Merge two NULL-terminated chains, nodes of @a first on ties */         \
+    static inline struct list_head *name##_merge_chain(                       \
+        struct list_head *a, struct list_head *b, bool descend)               \
+    {                                                                         \
+        if (descend)                                                          \
+            return list_merge(NULL, name##_cmp_descend, a, b);                \
+        return list_merge(NULL, name##_cmp_ascend, a, b);                     \
+    }                                                                         \
+                                                                              \
+    /* Link a NULL-terminated chain back to @q->head */                       \
+    static inline void name##_relink(struct name *q, struct list_head *chain) \
+    {                                                                         \
+        struct list_head *prev = &q->head;                                    \
+        for (; chain; prev = chain, chain = chain->next) {                    \
+            prev->next = chain;                                               \
+            chain->prev = prev;                                               \
+        }                                                                     \
+        prev->next = &q->head;                                                \
+        q->head.prev = prev;                                                  \
+    }                                                                         \
+                                                                              \
+    /* One instance of list_sort() per direction, with @cmp inlined */        \
+    static inline void name##_sort(struct name *q, bool descend)              \
+    {                                                                         \
+        if (!q)                                                               \
+            return;                                                           \
+        if (descend)                                                          \
+            list_sort(NULL, &q->head, name##_cmp_descend);                    \
+        else                                                                  \
+            list_sort(NULL, &q->head, name##_cmp_ascend);                     \
+    }                                                                         \
+                                                                              \
+    /* Keep the nodes no node to their right has to be placed before */       \
+    static inline int name##_monotonic(struct name *q, bool descend)          \
+    {                                                                         \
+        if (!q || list_empty(&q->head))                                       \
+            return 0;                                                         \
+        struct list_head *bound = q->head.prev, *node = bound->prev;          \
+        while (node != &q->head) {                                            \
+            struct list_head *prev = node->prev;                              \
+            if (name##_after(node, bound, descend))                           \
+                name##_remove_node(q, node, NULL);                            \
+            else                                                              \
+                bound = node;                                                 \
+            node = prev;                                                      \
+        }                                                                     \
+        return q->size;                                                       \
+    }                                                                         \
+                                                                              \
+    static inline int name##_ascend(struct name *q)                           \
+    {                                                                         \
+        return name##_monotonic(q, false);                                    \
+    }                                                                         \
+                                                                              \
+    static inline int name##_descend(struct name *q)                          \
+    {                                                                         \
+        return name##_monotonic(q, true);                                     \
+    }                                                                         \
+                                                                              \
+    static inline int name##_merge(struct name *q, struct name *other,        \
+                                   bool descend)                              \
+    {                                                                         \
+        if (!q)                                                               \
+            return 0;                                                         \
+        if (!other || list_empty(&other->head))                               \
+            return q->size;                                                   \
+        struct list_head *a = list_empty(&q->head) ? NULL : q->head.next;     \
+        q->head.prev->next = NULL;                                            \
+        other->head.prev->next = NULL;                                        \
+        name##_relink(q, name##_merge_chain(a, other->head.next, descend));   \
+        q->size += other->size;                                               \
+        INIT_LIST_HEAD(&other->head);                                         \
+        other->size = 0;                                                      \
+        return q->size;                                                       \
+    }
+
+#ifdef __cplusplus
+}
+#endif